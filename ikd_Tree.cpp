@@ -18,7 +18,9 @@ KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_l
     balance_criterion_param = balance_param;
     downsample_size = box_length;
     inv_downsample_size = 1.0f / downsample_size;
-    Rebuild_Logger.clear();
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+        Rebuild_Slots[i].Rebuild_Logger.clear();
+    pthread_mutex_init(&retire_mutex_lock, NULL);
     termination_flag = false;
     start_thread();
 }
@@ -29,14 +31,26 @@ KD_TREE<PointType>::~KD_TREE()
     stop_thread();
     Delete_Storage_Disabled = true;
     delete_tree_nodes(&Root_Node);
+    if (STATIC_ROOT_NODE != nullptr)
+    {
+        Node_Pool.release(STATIC_ROOT_NODE);
+        STATIC_ROOT_NODE = nullptr;
+    }
+    Frozen_Publish(nullptr);
     PointVector().swap(PCL_Storage);
-    Rebuild_Logger.clear();
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+        Rebuild_Slots[i].Rebuild_Logger.clear();
+    // No reader is left
+    Reclaim_Nodes(true);
+    pthread_mutex_destroy(&retire_mutex_lock);
 }
 
 template <typename PointType>
 void KD_TREE<PointType>::Delete_Ikd_Tree()
 {
     delete_tree_nodes(&Root_Node);
+    Frozen_Publish(nullptr);
+    Voxel_Occupancy_Reset();
     return;
 }
 
@@ -49,6 +63,21 @@ void KD_TREE<PointType>::InitializeKDTree(float delete_param, float balance_para
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::set_leaf_bucket_size(const int &bucket_size)
+{
+    // The rebuild threads read the size while they build, it only changes while none of them is running
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        while (Rebuild_Slots[i].running)
+            pthread_cond_wait(&rebuild_ptr_cond, &rebuild_ptr_mutex_lock);
+    }
+    leaf_bucket_size = std::max(0, std::min(bucket_size, Leaf_Bucket_Max));
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
 {
@@ -61,21 +90,24 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->node_range_y[1] = 0.0f;
     root->node_range_z[0] = 0.0f;
     root->node_range_z[1] = 0.0f;
-    root->radius_sq = 0.0f;
     root->division_axis = 0;
     root->father_ptr = nullptr;
     root->left_son_ptr = nullptr;
     root->right_son_ptr = nullptr;
+    root->bucket = nullptr;
     root->TreeSize = 0;
     root->invalid_point_num = 0;
     root->down_del_num = 0;
+    root->covered_num = 0;
+    root->covered_invalid_num = 0;
+    root->covered_down_del_num = 0;
     root->point_deleted = false;
     root->tree_deleted = false;
     root->need_push_down_to_left = false;
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
+    root->tree_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock), NULL);
     return;
 }
 
@@ -83,19 +115,21 @@ template <typename PointType>
 int KD_TREE<PointType>::size()
 {
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr || Rebuild_Slot_Of(Root_Node) < 0)
     {
-        if (Root_Node != nullptr)
-        {
-            return Root_Node->TreeSize;
-        }
-        else
-        {
-            return 0;
-        }
+        KD_TREE_NODE *root = Root_Node;
+        if (frozen_tree != nullptr)
+            s = frozen_tree->node_num;
+        else if (root != nullptr)
+            s = root->TreeSize;
+        Epoch.leave(reader);
+        return s;
     }
     else
     {
+        Epoch.leave(reader);
         if (!pthread_mutex_trylock(&working_flag_mutex))
         {
             s = Root_Node->TreeSize;
@@ -113,24 +147,38 @@ template <typename PointType>
 BoxPointType KD_TREE<PointType>::tree_range()
 {
     BoxPointType range;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
     {
-        if (Root_Node != nullptr)
+        for (int i = 0; i < 3; i++)
         {
-            range.vertex_min[0] = Root_Node->node_range_x[0];
-            range.vertex_min[1] = Root_Node->node_range_y[0];
-            range.vertex_min[2] = Root_Node->node_range_z[0];
-            range.vertex_max[0] = Root_Node->node_range_x[1];
-            range.vertex_max[1] = Root_Node->node_range_y[1];
-            range.vertex_max[2] = Root_Node->node_range_z[1];
+            range.vertex_min[i] = frozen_tree->range_min[i][0];
+            range.vertex_max[i] = frozen_tree->range_max[i][0];
+        }
+        Epoch.leave(reader);
+    }
+    else if (Rebuild_Slot_Of(Root_Node) < 0)
+    {
+        KD_TREE_NODE *root = Root_Node;
+        if (root != nullptr)
+        {
+            range.vertex_min[0] = root->node_range_x[0];
+            range.vertex_min[1] = root->node_range_y[0];
+            range.vertex_min[2] = root->node_range_z[0];
+            range.vertex_max[0] = root->node_range_x[1];
+            range.vertex_max[1] = root->node_range_y[1];
+            range.vertex_max[2] = root->node_range_z[1];
         }
         else
         {
             memset(&range, 0, sizeof(range));
         }
+        Epoch.leave(reader);
     }
     else
     {
+        Epoch.leave(reader);
         if (!pthread_mutex_trylock(&working_flag_mutex))
         {
             range.vertex_min[0] = Root_Node->node_range_x[0];
@@ -153,15 +201,21 @@ template <typename PointType>
 int KD_TREE<PointType>::validnum()
 {
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr || Rebuild_Slot_Of(Root_Node) < 0)
     {
-        if (Root_Node != nullptr)
-            return (Root_Node->TreeSize - Root_Node->invalid_point_num);
-        else
-            return 0;
+        KD_TREE_NODE *root = Root_Node;
+        if (frozen_tree != nullptr)
+            s = frozen_tree->node_num;
+        else if (root != nullptr)
+            s = root->TreeSize - root->invalid_point_num;
+        Epoch.leave(reader);
+        return s;
     }
     else
     {
+        Epoch.leave(reader);
         if (!pthread_mutex_trylock(&working_flag_mutex))
         {
             s = Root_Node->TreeSize - Root_Node->invalid_point_num;
@@ -178,18 +232,25 @@ int KD_TREE<PointType>::validnum()
 template <typename PointType>
 void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del)
 {
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    if (frozen())
+    {
+        // Median split without deleted points
+        alpha_bal = 0.5;
+        alpha_del = 0.0;
+        return;
+    }
+    if (Rebuild_Slot_Of(Root_Node) < 0)
     {
-        alpha_bal = Root_Node->alpha_bal;
-        alpha_del = Root_Node->alpha_del;
+        alpha_bal = root_alpha_bal;
+        alpha_del = root_alpha_del;
         return;
     }
     else
     {
         if (!pthread_mutex_trylock(&working_flag_mutex))
         {
-            alpha_bal = Root_Node->alpha_bal;
-            alpha_del = Root_Node->alpha_del;
+            alpha_bal = root_alpha_bal;
+            alpha_del = root_alpha_del;
             pthread_mutex_unlock(&working_flag_mutex);
             return;
         }
@@ -203,16 +264,26 @@ void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del)
     return;
 }
 
+template <typename PointType>
+int KD_TREE<PointType>::rebuild_log_overflow()
+{
+    return Rebuild_Overflow_Num.load();
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::start_thread()
 {
     pthread_mutex_init(&termination_flag_mutex_lock, NULL);
     pthread_mutex_init(&rebuild_ptr_mutex_lock, NULL);
-    pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL);
     pthread_mutex_init(&working_flag_mutex, NULL);
-    pthread_mutex_init(&search_flag_mutex, NULL);
-    pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this);
+    pthread_cond_init(&rebuild_ptr_cond, NULL);
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        Rebuild_Slots[i].tree = this;
+        Rebuild_Slots[i].slot_id = i;
+        pthread_create(&Rebuild_Slots[i].rebuild_thread, NULL, multi_thread_ptr, (void *)&Rebuild_Slots[i]);
+    }
     printf("Multi thread started \n");
     return;
 }
@@ -223,28 +294,35 @@ void KD_TREE<PointType>::stop_thread()
     pthread_mutex_lock(&termination_flag_mutex_lock);
     termination_flag = true;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
-    if (rebuild_thread)
-        pthread_join(rebuild_thread, NULL);
+    // Wake the rebuild threads up if they are waiting for a subtree
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    pthread_cond_broadcast(&rebuild_ptr_cond);
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        if (Rebuild_Slots[i].rebuild_thread)
+            pthread_join(Rebuild_Slots[i].rebuild_thread, NULL);
+    }
     pthread_mutex_destroy(&termination_flag_mutex_lock);
-    pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
-    pthread_mutex_destroy(&search_flag_mutex);
+    pthread_cond_destroy(&rebuild_ptr_cond);
     return;
 }
 
 template <typename PointType>
 void *KD_TREE<PointType>::multi_thread_ptr(void *arg)
 {
-    KD_TREE *handle = (KD_TREE *)arg;
-    handle->multi_thread_rebuild();
+    REBUILD_SLOT *slot = (REBUILD_SLOT *)arg;
+    slot->tree->multi_thread_rebuild(slot->slot_id);
     return nullptr;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::multi_thread_rebuild()
+void KD_TREE<PointType>::multi_thread_rebuild(const int &slot_id)
 {
+    REBUILD_SLOT &slot = Rebuild_Slots[slot_id];
     bool terminated = false;
     KD_TREE_NODE *father_ptr;
     pthread_mutex_lock(&termination_flag_mutex_lock);
@@ -253,101 +331,108 @@ void KD_TREE<PointType>::multi_thread_rebuild()
     while (!terminated)
     {
         pthread_mutex_lock(&rebuild_ptr_mutex_lock);
-        pthread_mutex_lock(&working_flag_mutex);
-        if (Rebuild_Ptr != nullptr)
+        // Sleep until Rebuild posts a subtree to this slot or stop_thread is called
+        while (slot.Rebuild_Ptr == nullptr)
+        {
+            pthread_mutex_lock(&termination_flag_mutex_lock);
+            terminated = termination_flag;
+            pthread_mutex_unlock(&termination_flag_mutex_lock);
+            if (terminated)
+                break;
+            pthread_cond_wait(&rebuild_ptr_cond, &rebuild_ptr_mutex_lock);
+        }
+        slot.running = slot.Rebuild_Ptr != nullptr;
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        if (slot.running)
         {
+            pthread_mutex_lock(&working_flag_mutex);
             /* Traverse and copy */
-            if (!Rebuild_Logger.empty())
+            if (!slot.Rebuild_Logger.empty())
             {
                 printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
             }
-            rebuild_flag = true;
-            if (*Rebuild_Ptr == Root_Node)
+            slot.rebuild_flag = true;
+            if (*slot.Rebuild_Ptr == Root_Node)
             {
                 Treesize_tmp = Root_Node->TreeSize;
                 Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
-                alpha_bal_tmp = Root_Node->alpha_bal;
-                alpha_del_tmp = Root_Node->alpha_del;
-            }
-            KD_TREE_NODE *old_root_node = (*Rebuild_Ptr);
-            father_ptr = (*Rebuild_Ptr)->father_ptr;
-            PointVector().swap(Rebuild_PCL_Storage);
-            // Lock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
-            {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
+                alpha_bal_tmp = root_alpha_bal;
+                alpha_del_tmp = root_alpha_del;
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            KD_TREE_NODE *old_root_node = (*slot.Rebuild_Ptr);
+            father_ptr = (*slot.Rebuild_Ptr)->father_ptr;
+            PointVector().swap(slot.Rebuild_PCL_Storage);
             // Lock deleted points cache
             pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
-            flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
+            flatten(*slot.Rebuild_Ptr, slot.Rebuild_PCL_Storage, MULTI_THREAD_REC);
             // Unlock deleted points cache
             pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
             pthread_mutex_unlock(&working_flag_mutex);
             /* Rebuild and update missed operations*/
-            Operation_Logger_Type Operation;
             KD_TREE_NODE *new_root_node = nullptr;
-            if (int(Rebuild_PCL_Storage.size()) > 0)
+            if (int(slot.Rebuild_PCL_Storage.size()) > 0)
+                BuildTree(&new_root_node, 0, slot.Rebuild_PCL_Storage.size() - 1, slot.Rebuild_PCL_Storage);
+            // Rebuild has been done. Updates the blocked operations into the new tree
+            // The log is lock-free, working_flag_mutex is only needed to see it empty before the swap
+            vector<Operation_Logger_Type> replay_batch;
+            pthread_mutex_lock(&working_flag_mutex);
+            while (!slot.Rebuild_Logger.empty() && !slot.Rebuild_Logger.overflowed())
             {
-                BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size() - 1, Rebuild_PCL_Storage);
-                // Rebuild has been done. Updates the blocked operations into the new tree
-                pthread_mutex_lock(&working_flag_mutex);
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                int tmp_counter = 0;
-                while (!Rebuild_Logger.empty())
+                pthread_mutex_unlock(&working_flag_mutex);
+                while (!slot.Rebuild_Logger.empty() && !slot.Rebuild_Logger.overflowed())
                 {
-                    Operation = Rebuild_Logger.front();
-                    max_queue_size = std::max(max_queue_size, Rebuild_Logger.size());
-                    Rebuild_Logger.pop();
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-                    pthread_mutex_unlock(&working_flag_mutex);
-                    run_operation(&new_root_node, Operation);
-                    tmp_counter++;
-                    if (tmp_counter % 10 == 0)
-                        usleep(1);
-                    pthread_mutex_lock(&working_flag_mutex);
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                    max_queue_size = std::max(max_queue_size, slot.Rebuild_Logger.size());
+                    replay_batch.clear();
+                    while (!slot.Rebuild_Logger.empty() && int(replay_batch.size()) < Replay_Batch_Num)
+                    {
+                        replay_batch.push_back(slot.Rebuild_Logger.front());
+                        slot.Rebuild_Logger.pop();
+                    }
+                    Replay_Operations(&new_root_node, replay_batch);
+                    sched_yield();
                 }
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&working_flag_mutex);
             }
-            /* Replace to original tree*/
-            // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
+            if (slot.Rebuild_Logger.overflowed())
             {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
+                // Operations were dropped, keep the original subtree the writer has kept up to date
+                Rebuild_Overflow_Num++;
+                printf("Rebuild log overflow: more than %d operations pending, rebuild abandoned\n", Q_LEN);
+                slot.rebuild_flag = false;
+                slot.Rebuild_Logger.clear();
+                pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+                slot.Rebuild_Ptr = nullptr;
+                slot.running = false;
+                pthread_cond_broadcast(&rebuild_ptr_cond);
+                pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+                pthread_mutex_unlock(&working_flag_mutex);
+                delete_tree_nodes(&new_root_node);
+                pthread_mutex_lock(&termination_flag_mutex_lock);
+                terminated = termination_flag;
+                pthread_mutex_unlock(&termination_flag_mutex_lock);
+                continue;
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
-            if (father_ptr->left_son_ptr == *Rebuild_Ptr)
+            /* Replace to original tree*/
+            // Readers still inside the old subtree finish there, its nodes are retired below
+            if (new_root_node != nullptr)
+                new_root_node->father_ptr = father_ptr;
+            if (father_ptr->left_son_ptr == *slot.Rebuild_Ptr)
             {
-                father_ptr->left_son_ptr = new_root_node;
+                Publish_Node(&father_ptr->left_son_ptr, new_root_node);
             }
-            else if (father_ptr->right_son_ptr == *Rebuild_Ptr)
+            else if (father_ptr->right_son_ptr == *slot.Rebuild_Ptr)
             {
-                father_ptr->right_son_ptr = new_root_node;
+                Publish_Node(&father_ptr->right_son_ptr, new_root_node);
             }
             else
             {
                 throw "Error: Father ptr incompatible with current node\n";
             }
-            if (new_root_node != nullptr)
-                new_root_node->father_ptr = father_ptr;
-            (*Rebuild_Ptr) = new_root_node;
+            (*slot.Rebuild_Ptr) = new_root_node;
 
             if (father_ptr == STATIC_ROOT_NODE)
                 Root_Node = STATIC_ROOT_NODE->left_son_ptr;
-            KD_TREE_NODE *update_root = *Rebuild_Ptr;
+            KD_TREE_NODE *update_root = *slot.Rebuild_Ptr;
             while (update_root != nullptr && update_root != Root_Node)
             {
                 update_root = update_root->father_ptr;
@@ -359,36 +444,98 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                     break;
                 Update(update_root);
             }
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
-            Rebuild_Ptr = nullptr;
+            slot.rebuild_flag = false;
+            // Release the drained chunks, an idle log holds no memory
+            slot.Rebuild_Logger.clear();
+            // Frees the slot, Freeze may be waiting for it
+            pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+            slot.Rebuild_Ptr = nullptr;
+            slot.running = false;
+            pthread_cond_broadcast(&rebuild_ptr_cond);
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
             pthread_mutex_unlock(&working_flag_mutex);
-            rebuild_flag = false;
             /* Delete discarded tree nodes */
             delete_tree_nodes(&old_root_node);
         }
-        else
-        {
-            pthread_mutex_unlock(&working_flag_mutex);
-        }
-        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         pthread_mutex_lock(&termination_flag_mutex_lock);
         terminated = termination_flag;
         pthread_mutex_unlock(&termination_flag_mutex_lock);
-        usleep(100);
     }
     printf("Rebuild thread terminated normally\n");
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Replay_Operations(KD_TREE_NODE **root, vector<Operation_Logger_Type> &operations)
+{
+    // Runs of the same operation commute, so each run is reordered or merged before it is applied:
+    // points are sorted so consecutive descents share their path, boxes inside the previous box
+    // of the run are dropped and consecutive root push downs are folded into one.
+    auto point_less = [](const Operation_Logger_Type &a, const Operation_Logger_Type &b)
+    {
+        if (a.point.x != b.point.x)
+            return a.point.x < b.point.x;
+        if (a.point.y != b.point.y)
+            return a.point.y < b.point.y;
+        return a.point.z < b.point.z;
+    };
+    size_t i = 0;
+    while (i < operations.size())
+    {
+        size_t j = i + 1;
+        while (j < operations.size() && operations[j].op == operations[i].op)
+            j++;
+        switch (operations[i].op)
+        {
+            case ADD_POINT:
+            case DELETE_POINT:
+            case SET_COVERED:
+                std::sort(operations.begin() + i, operations.begin() + j, point_less);
+                for (size_t k = i; k < j; k++)
+                    run_operation(root, operations[k]);
+                break;
+            case ADD_BOX:
+            case DELETE_BOX:
+            case DOWNSAMPLE_DELETE:
+            {
+                size_t last = i;
+                for (size_t k = i + 1; k < j; k++)
+                {
+                    if (box_contains(operations[last].boxpoint, operations[k].boxpoint))
+                        continue;
+                    if (!box_contains(operations[k].boxpoint, operations[last].boxpoint))
+                        run_operation(root, operations[last]);
+                    last = k;
+                }
+                run_operation(root, operations[last]);
+                break;
+            }
+            case PUSH_DOWN:
+            {
+                // Downsample labels accumulate, the tree_deleted label of the last one wins
+                Operation_Logger_Type push_down = operations[j - 1];
+                for (size_t k = i; k < j; k++)
+                    push_down.tree_downsample_deleted |= operations[k].tree_downsample_deleted;
+                run_operation(root, push_down);
+                break;
+            }
+            default:
+                for (size_t k = i; k < j; k++)
+                    run_operation(root, operations[k]);
+                break;
+        }
+        i = j;
+    }
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation)
 {
     switch (operation.op)
     {
         case ADD_POINT:
-            Add_by_point(root, operation.point, false, (*root)->division_axis);
+            Add_by_point(root, operation.point, false, (*root == nullptr) ? 2 : (*root)->division_axis);
             break;
         case ADD_BOX:
             Add_by_range(root, operation.boxpoint, false);
@@ -402,17 +549,31 @@ void KD_TREE<PointType>::run_operation(KD_TREE_NODE **root, Operation_Logger_Typ
         case DOWNSAMPLE_DELETE:
             Delete_by_range(root, operation.boxpoint, false, true);
             break;
+        case SET_COVERED:
+            Set_Covered_by_point(root, operation.point);
+            break;
         case PUSH_DOWN:
+            if (*root == nullptr)
+                break;
             (*root)->tree_downsample_deleted |= operation.tree_downsample_deleted;
             (*root)->point_downsample_deleted |= operation.tree_downsample_deleted;
             (*root)->tree_deleted = operation.tree_deleted || (*root)->tree_downsample_deleted;
             (*root)->point_deleted = (*root)->tree_deleted || (*root)->point_downsample_deleted;
             if (operation.tree_downsample_deleted)
+            {
                 (*root)->down_del_num = (*root)->TreeSize;
+                (*root)->covered_down_del_num = (*root)->covered_num;
+            }
             if (operation.tree_deleted)
+            {
                 (*root)->invalid_point_num = (*root)->TreeSize;
+                (*root)->covered_invalid_num = (*root)->covered_num;
+            }
             else
+            {
                 (*root)->invalid_point_num = (*root)->down_del_num;
+                (*root)->covered_invalid_num = (*root)->covered_down_del_num;
+            }
             (*root)->need_push_down_to_left = true;
             (*root)->need_push_down_to_right = true;
             break;
@@ -429,361 +590,1419 @@ void KD_TREE<PointType>::Build(PointVector &point_cloud)
     {
         delete_tree_nodes(&Root_Node);
     }
+    Voxel_Occupancy_Reset();
     if (point_cloud.size() == 0)
+    {
+        Frozen_Publish(nullptr);
         return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    }
+    if (STATIC_ROOT_NODE != nullptr)
+        Node_Pool.release(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE = Node_Pool.allocate();
     InitTreeNode(STATIC_ROOT_NODE);
-    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
+    if (int(point_cloud.size()) >= Parallel_Point_Num && Worker_Pool.size() > 1)
+    {
+        // Split in parallel first, then only create the nodes
+        vector<ARRANGED_SPLIT> arranged(point_cloud.size());
+        Arrange_Storage(0, point_cloud.size() - 1, point_cloud, arranged.data(), Build_Fork_Depth(), true);
+        BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud, nullptr, arranged.data());
+    }
+    else
+        BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
-    Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+    Publish_Node(&Root_Node, STATIC_ROOT_NODE->left_son_ptr);
+    // Queries of a frozen tree move to the new one from here
+    Frozen_Publish(nullptr);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Nearest_Search(const PointType &point, const int &k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, const float &max_dist)
+void KD_TREE<PointType>::Voxelize_Points(const PointVector &PointToVoxelize, PointVector &Voxel_Centers)
 {
-    MANUAL_HEAP q(2 * k_nearest);
-    q.clear();
-    vector<float>().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    // Keeps the center of every occupied voxel once, in order of first occurrence
+    int point_num = PointToVoxelize.size();
+    int task_num = std::max(1, std::min(Worker_Pool.size(), point_num / Parallel_Point_Num));
+    int chunk_size = (point_num + task_num - 1) / task_num;
+    PointVector centers(point_num);
+    vector<int64_t> keys(point_num);
+    vector<char> first_in_voxel(point_num, 0);
+    // Each chunk computes its centers and buckets its indices by key partition
+    vector<vector<vector<int>>> partitions(task_num, vector<vector<int>>(task_num));
+    parallel_for(task_num, [&](int chunk)
     {
-        Search(Root_Node, k_nearest, point, q, max_dist);
-    }
-    else
+        int end = std::min(point_num, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; i++)
+        {
+            centers[i] = PointToVoxelize[i];
+            centers[i].x = (int(PointToVoxelize[i].x * inv_downsample_size) - std::signbit(PointToVoxelize[i].x) + 0.5) * downsample_size;
+            centers[i].y = (int(PointToVoxelize[i].y * inv_downsample_size) - std::signbit(PointToVoxelize[i].y) + 0.5) * downsample_size;
+            centers[i].z = (int(PointToVoxelize[i].z * inv_downsample_size) - std::signbit(PointToVoxelize[i].z) + 0.5) * downsample_size;
+            keys[i] = voxel_key(centers[i]);
+            partitions[chunk][(uint64_t(keys[i]) * 0x9E3779B97F4A7C15ULL >> 32) % task_num].push_back(i);
+        }
+    });
+    // Each partition owns a disjoint set of keys; chunks are visited in input order so the first occurrence wins
+    parallel_for(task_num, [&](int partition)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        while (search_mutex_counter == -1)
+        unordered_set<int64_t> seen_keys;
+        for (int chunk = 0; chunk < task_num; chunk++)
         {
-            pthread_mutex_unlock(&search_flag_mutex);
-            usleep(1);
-            pthread_mutex_lock(&search_flag_mutex);
+            const vector<int> &indices = partitions[chunk][partition];
+            for (size_t j = 0; j < indices.size(); j++)
+            {
+                if (seen_keys.insert(keys[indices[j]]).second)
+                    first_in_voxel[indices[j]] = 1;
+            }
         }
-        search_mutex_counter += 1;
-        pthread_mutex_unlock(&search_flag_mutex);
-        Search(Root_Node, k_nearest, point, q, max_dist);
-        pthread_mutex_lock(&search_flag_mutex);
-        search_mutex_counter -= 1;
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    int k_found = std::min(k_nearest, int(q.size()));
-    PointVector().swap(Nearest_Points);
-    vector<float>().swap(Point_Distance);
-    for (int i = 0; i < k_found; i++)
+    });
+    Voxel_Centers.clear();
+    for (int i = 0; i < point_num; i++)
     {
-        Nearest_Points.insert(Nearest_Points.begin(), q.top().point);
-        Point_Distance.insert(Point_Distance.begin(), q.top().dist);
-        q.pop();
+        if (first_in_voxel[i])
+            Voxel_Centers.push_back(centers[i]);
     }
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+template <typename Func>
+void KD_TREE<PointType>::parallel_for(const int &task_num, Func func)
 {
-    Storage.clear();
-    Search_by_range(Root_Node, Box_of_Point, Storage);
+    Worker_Pool.run(task_num, std::function<void(int)>(func));
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Radius_Search(const PointType &point, const float &radius, PointVector &Storage)
+void KD_TREE<PointType>::Freeze()
 {
-    Storage.clear();
-    Search_by_radius(Root_Node, point, radius, Storage);
+    // Moves the valid points into the read-only layout and releases the dynamic tree
+    if (frozen())
+        return;
+    // Waits for the running rebuilds and keeps the threads out, rebuilds not started yet are dropped with the tree
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        while (Rebuild_Slots[i].running)
+            pthread_cond_wait(&rebuild_ptr_cond, &rebuild_ptr_mutex_lock);
+        Rebuild_Slots[i].Rebuild_Ptr = nullptr;
+    }
+    PointVector Storage;
+    flatten(Root_Node, Storage, DELETE_POINTS_REC);
+    if (Storage.empty())
+    {
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        return;
+    }
+    int node_num = Storage.size();
+    void *block = nullptr;
+    if (posix_memalign(&block, 64, Frozen_Block_Bytes(node_num)) != 0)
+        throw std::bad_alloc();
+    memset(block, 0, Frozen_Block_Bytes(node_num));
+    FROZEN_TREE *frozen_tree = new FROZEN_TREE;
+    Frozen_Assign(*frozen_tree, (char *)block, node_num);
+    Frozen_Build(*frozen_tree, 0, node_num, Storage, 0);
+    // Queries move to the frozen layout before the dynamic tree is retired
+    Frozen_Publish(frozen_tree);
+    delete_tree_nodes(&Root_Node);
+    STATIC_ROOT_NODE->left_son_ptr = nullptr;
+    Voxel_Occupancy_Reset();
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
     return;
 }
 
 template <typename PointType>
-bool KD_TREE<PointType>::CollisionLineCheck(const PointType &point1, const PointType &point2, const float &radius)
+void KD_TREE<PointType>::Unfreeze()
 {
-    if (CollisionCheck(point1, radius)) return true;
-    if (CollisionCheck(point2, radius)) return true;
+    // Builds the dynamic tree again from the frozen points
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree == nullptr)
+        return;
+    // Build releases the frozen layout once the new tree is linked
+    PointVector Storage(frozen_tree->points, frozen_tree->points + frozen_tree->node_num);
+    Build(Storage);
+    return;
+}
 
-    int steps = std::ceil(std::sqrt(calc_dist(point1, point2)) / downsample_size);
-    float stepX = (point2.x - point1.x) / steps;
-    float stepY = (point2.y - point1.y) / steps;
-    float stepZ = (point2.z - point1.z) / steps;
-    PointType searchPoint = point1;
-    for (int i = 1; i < steps; ++i)
+template <typename PointType>
+void KD_TREE<PointType>::Snapshot_Header_Init(SNAPSHOT_HEADER &header, const int &node_num)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDTREE", 8);
+    header.version = Snapshot_Version;
+    header.point_bytes = sizeof(PointType);
+    header.bucket_size = Frozen_Bucket_Size;
+    header.node_num = node_num;
+    header.block_bytes = Frozen_Block_Bytes(node_num);
+    PointType point;
+    header.has_coverage = Traits::has_coverage ? 1 : 0;
+    header.coord_offset[0] = (char *)&point.x - (char *)&point;
+    header.coord_offset[1] = (char *)&point.y - (char *)&point;
+    header.coord_offset[2] = (char *)&point.z - (char *)&point;
+    // The covered flag is found as the first byte set_covered changes
+    unsigned char uncovered_bytes[sizeof(PointType)];
+    Traits::set_covered(point, false);
+    memcpy(uncovered_bytes, &point, sizeof(PointType));
+    Traits::set_covered(point, true);
+    const unsigned char *covered_bytes = (const unsigned char *)&point;
+    for (uint32_t i = 0; i < sizeof(PointType) && header.has_coverage; i++)
     {
-        searchPoint.x += stepX;
-        searchPoint.y += stepY;
-        searchPoint.z += stepZ;
-        if (CollisionCheck(searchPoint, radius))
+        if (covered_bytes[i] != uncovered_bytes[i])
         {
-            return true;
+            header.covered_offset = i;
+            break;
         }
     }
-
-    return false;
+    // FNV-1a of the type name
+    header.type_hash = 14695981039346656037ull;
+    for (const char *c = typeid(PointType).name(); *c != 0; c++)
+        header.type_hash = (header.type_hash ^ (unsigned char)(*c)) * 1099511628211ull;
+    return;
 }
 
 template <typename PointType>
-bool KD_TREE<PointType>::CollisionLineCheckExceptOrigin(const PointType &origin, const PointType &point1, const PointType &point2, const float &radius)
+bool KD_TREE<PointType>::Save_Snapshot(const string &path)
 {
-    if (CollisionCheck(point1, radius) && !same_point(origin, point1)) return true;
-    if (CollisionCheck(point2, radius) && !same_point(origin, point2)) return true;
+    // Writes the frozen layout (freezing the tree first) so Load_Snapshot can map it without a build.
+    // Returns false for an empty tree or a failed write
+    Freeze();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree == nullptr)
+        return false;
+    char header_block[Snapshot_Header_Bytes] = {0};
+    SNAPSHOT_HEADER header;
+    Snapshot_Header_Init(header, frozen_tree->node_num);
+    memcpy(header_block, &header, sizeof(header));
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+    bool written = fwrite(header_block, 1, Snapshot_Header_Bytes, file) == Snapshot_Header_Bytes;
+    written = written && fwrite(frozen_tree->block, 1, frozen_tree->block_bytes, file) == frozen_tree->block_bytes;
+    written = (fclose(file) == 0) && written;
+    return written;
+}
 
-    int steps = std::ceil(std::sqrt(calc_dist(point1, point2)) / downsample_size);
-    float stepX = (point2.x - point1.x) / steps;
-    float stepY = (point2.y - point1.y) / steps;
-    float stepZ = (point2.z - point1.z) / steps;
-    PointType searchPoint = point1;
-    for (int i = 1; i < steps; ++i)
+template <typename PointType>
+bool KD_TREE<PointType>::Load_Snapshot(const string &path)
+{
+    // Maps a Save_Snapshot file as the frozen layout in place of the current tree. Pages are read when a
+    // query first touches them, and the first modification unfreezes (reads) the whole map as usual.
+    // Queries may run meanwhile, as with Freeze. Returns false, keeping the tree, if the file does not match
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    SNAPSHOT_HEADER header, expected;
+    struct stat file_stat;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &file_stat) == 0 && header.node_num > 0;
+    if (valid)
     {
-        searchPoint.x += stepX;
-        searchPoint.y += stepY;
-        searchPoint.z += stepZ;
-        if (CollisionCheck(searchPoint, radius))
-        {
-            return true;
-        }
+        Snapshot_Header_Init(expected, header.node_num);
+        valid = memcmp(&header, &expected, sizeof(header)) == 0 && size_t(file_stat.st_size) == Snapshot_Header_Bytes + header.block_bytes;
     }
-
-    return false;
+    void *map = valid ? mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    // Drops the current tree as Freeze does
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        while (Rebuild_Slots[i].running)
+            pthread_cond_wait(&rebuild_ptr_cond, &rebuild_ptr_mutex_lock);
+        Rebuild_Slots[i].Rebuild_Ptr = nullptr;
+    }
+    FROZEN_TREE *frozen_tree = new FROZEN_TREE;
+    Frozen_Assign(*frozen_tree, (char *)map + Snapshot_Header_Bytes, header.node_num);
+    frozen_tree->map_base = (char *)map;
+    frozen_tree->map_bytes = file_stat.st_size;
+    Frozen_Publish(frozen_tree);
+    delete_tree_nodes(&Root_Node);
+    if (STATIC_ROOT_NODE != nullptr)
+        STATIC_ROOT_NODE->left_son_ptr = nullptr;
+    Voxel_Occupancy_Reset();
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    return true;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Ray_Cast(const PointType &pt, const PointType &dir, const float& radius, PointType& hit_point, const float& max_dist)
+void KD_TREE<PointType>::Nearest_Search(const PointType &point, const int &k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, const float &max_dist)
 {
-    float dir_length = std::sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
-    float norm_dir_x = dir.x / dir_length;
-    float norm_dir_y = dir.y / dir_length;
-    float norm_dir_z = dir.z / dir_length;
-    
-    float stepX = norm_dir_x * downsample_size;
-    float stepY = norm_dir_y * downsample_size;
-    float stepZ = norm_dir_z * downsample_size;
-    int steps = std::ceil(max_dist / downsample_size);
-    PointType search_pt = pt;
-    
-    for (int i = 0; i < steps; ++i)
-    {
-        if (CollisionCheck(search_pt, radius))
-        {
-            hit_point = search_pt;
-            return;
-        }
-        search_pt.x += stepX;
-        search_pt.y += stepY;
-        search_pt.z += stepZ;
-    }
-    
-    hit_point.x = pt.x + norm_dir_x * max_dist;
-    hit_point.y = pt.y + norm_dir_y * max_dist;
-    hit_point.z = pt.z + norm_dir_z * max_dist;
+    Nearest_Points.resize(std::max(k_nearest, 0));
+    Point_Distance.resize(std::max(k_nearest, 0));
+    int k_found = Nearest_Search(point, k_nearest, Nearest_Points.data(), Point_Distance.data(), max_dist);
+    Nearest_Points.resize(k_found);
+    Point_Distance.resize(k_found);
+    return;
 }
 
 template <typename PointType>
-bool KD_TREE<PointType>::CollisionCheck(const PointType &point, const float &radius)
+int KD_TREE<PointType>::Nearest_Search(const PointType &point, const int &k_nearest, PointType *Nearest_Points, float *Point_Distance, const float &max_dist)
 {
-    return CollisionCheckRecursive(Root_Node, point, radius);
+    // Nearest_Points and Point_Distance must hold k_nearest entries, returns the number found (nearest first)
+    if (k_nearest <= 0)
+        return 0;
+    int reader = Epoch.enter();
+    int k_found;
+    if (k_nearest <= Small_K_Nearest)
+    {
+        MANUAL_SMALL_HEAP q;
+        k_found = Nearest_Search_by_heap(point, k_nearest, q, Nearest_Points, Point_Distance, max_dist);
+    }
+    else
+    {
+        static thread_local MANUAL_HEAP q(0);
+        q.reserve(2 * k_nearest);
+        k_found = Nearest_Search_by_heap(point, k_nearest, q, Nearest_Points, Point_Distance, max_dist);
+    }
+    Epoch.leave(reader);
+    return k_found;
 }
 
 template <typename PointType>
-int KD_TREE<PointType>::Add_Points(const PointVector &PointToAdd, const bool &downsample_on)
+template <typename HeapType>
+int KD_TREE<PointType>::Nearest_Search_by_heap(const PointType &point, const int &k_nearest, HeapType &q, PointType *Nearest_Points, float *Point_Distance, const float &max_dist)
 {
-    BoxPointType Box_of_Point;
-    PointType mid_point;
-    int tmp_counter = 0;
-
-    // If not built, Build first
-    if (Root_Node == nullptr)
+    q.clear();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
     {
-        PointVector PointToBuild = PointToAdd;
-        if (downsample_on) //Input points for Build is also modified to use grid-aligned Downsampling
-        {
-            PointVector PointToAddDownsampled;
-            for (size_t i = 0; i < PointToBuild.size(); ++i)
-            {
-                mid_point.x = (int(PointToBuild[i].x * inv_downsample_size) - std::signbit(PointToBuild[i].x) + 0.5) * downsample_size;
-                mid_point.y = (int(PointToBuild[i].y * inv_downsample_size) - std::signbit(PointToBuild[i].y) + 0.5) * downsample_size;
-                mid_point.z = (int(PointToBuild[i].z * inv_downsample_size) - std::signbit(PointToBuild[i].z) + 0.5) * downsample_size;
-                // if current mid_point is not already in the vector, push
-                if (PointToAddDownsampled.end() == (find_if(PointToAddDownsampled.begin(), PointToAddDownsampled.end(), 
-                    [&](PointType pt){return same_point(mid_point, pt);})))
-                    PointToAddDownsampled.push_back(mid_point);
-            }
-            PointToAddDownsampled.swap(PointToBuild);
-        }
-        Build(PointToBuild);
-        return 0;
+        if (Frozen_Box_Dist(*frozen_tree, 0, point) <= max_dist * max_dist)
+            Frozen_Search(*frozen_tree, 0, frozen_tree->node_num, k_nearest, point, q, max_dist * max_dist);
     }
-
-    // If built, Add points
-    for (size_t i = 0; i < PointToAdd.size(); i++)
+    else
+        Search(Root_Node, k_nearest, point, q, max_dist);
+    int k_found = std::min(k_nearest, int(q.size()));
+    // The heap pops the farthest first
+    for (int i = k_found - 1; i >= 0; i--)
     {
-        if (downsample_on)
-        {
-            int x_key = int(PointToAdd[i].x * inv_downsample_size) - std::signbit(PointToAdd[i].x);
-            int y_key = int(PointToAdd[i].y * inv_downsample_size) - std::signbit(PointToAdd[i].y);
-            int z_key = int(PointToAdd[i].z * inv_downsample_size) - std::signbit(PointToAdd[i].z);
-
-            Box_of_Point.vertex_min[0] = x_key * downsample_size;
-            Box_of_Point.vertex_max[0] = Box_of_Point.vertex_min[0] + downsample_size;
-            Box_of_Point.vertex_min[1] = y_key * downsample_size;
-            Box_of_Point.vertex_max[1] = Box_of_Point.vertex_min[1] + downsample_size;
-            Box_of_Point.vertex_min[2] = z_key * downsample_size;
-            Box_of_Point.vertex_max[2] = Box_of_Point.vertex_min[2] + downsample_size;
-            mid_point.x = (x_key + 0.5) * downsample_size;
-            mid_point.y = (y_key + 0.5) * downsample_size;
-            mid_point.z = (z_key + 0.5) * downsample_size;
-            PointVector().swap(Downsample_Storage);
-            Search_by_range(Root_Node, Box_of_Point, Downsample_Storage);
-            
-            if (Downsample_Storage.size() > 0) // a point already exists in the voxel grid, do nothing
-                continue;
-            else // add a point (not raw, but as the mid point (centroid) of voxel grid)
-            {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
-                {
-                    Add_by_point(&Root_Node, mid_point, true, Root_Node->division_axis);
-                    tmp_counter++;
-                }
-                else
-                {
-                    Operation_Logger_Type operation;
-                    operation.point = mid_point;
-                    operation.op = ADD_POINT;
-                    pthread_mutex_lock(&working_flag_mutex);
-                    Add_by_point(&Root_Node, mid_point, false, Root_Node->division_axis);
-                    tmp_counter++;
-                    if (rebuild_flag)
-                    {
-                        pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                        Rebuild_Logger.push(operation);
-                        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-                    }
-                    pthread_mutex_unlock(&working_flag_mutex);
-                }
-            }
-        }
-        else
-        {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
-            {
-                Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);
-            }
-            else
-            {
-                Operation_Logger_Type operation;
-                operation.point = PointToAdd[i];
-                operation.op = ADD_POINT;
-                pthread_mutex_lock(&working_flag_mutex);
-                Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
-                if (rebuild_flag)
-                {
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                    Rebuild_Logger.push(operation);
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-                }
-                pthread_mutex_unlock(&working_flag_mutex);
-            }
-        }
+        Nearest_Points[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
     }
-    return tmp_counter;
+    return k_found;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Add_Point_Boxes(const vector<BoxPointType> &BoxPoints)
+void KD_TREE<PointType>::Nearest_Search_Batch(const PointVector &Query_Points, const int &k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, vector<int> &Found_Num, const float &max_dist)
 {
-    for (size_t i = 0; i < BoxPoints.size(); i++)
+    // Results of query i are at [i * k_nearest, i * k_nearest + Found_Num[i]), nearest first
+    int query_num = Query_Points.size();
+    Nearest_Points.resize(query_num * k_nearest);
+    Point_Distance.resize(query_num * k_nearest);
+    Found_Num.resize(query_num);
+    if (query_num == 0 || k_nearest <= 0)
+        return;
+    // One epoch for the whole batch, the workers run inside it
+    int reader = Epoch.enter();
+    int task_num = std::max(1, std::min(Worker_Pool.size(), query_num / 64));
+    int chunk_size = (query_num + task_num - 1) / task_num;
+    parallel_for(task_num, [&](int chunk)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
-        {
-            Add_by_range(&Root_Node, BoxPoints[i], true);
-        }
-        else
+        MANUAL_SMALL_HEAP small_q;
+        MANUAL_HEAP q(k_nearest <= Small_K_Nearest ? 0 : 2 * k_nearest);
+        int end = std::min(query_num, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; i++)
         {
-            Operation_Logger_Type operation;
-            operation.boxpoint = BoxPoints[i];
-            operation.op = ADD_BOX;
-            pthread_mutex_lock(&working_flag_mutex);
-            Add_by_range(&Root_Node, BoxPoints[i], false);
-            if (rebuild_flag)
-            {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }
-            pthread_mutex_unlock(&working_flag_mutex);
+            if (k_nearest <= Small_K_Nearest)
+                Found_Num[i] = Nearest_Search_by_heap(Query_Points[i], k_nearest, small_q, &Nearest_Points[i * k_nearest], &Point_Distance[i * k_nearest], max_dist);
+            else
+                Found_Num[i] = Nearest_Search_by_heap(Query_Points[i], k_nearest, q, &Nearest_Points[i * k_nearest], &Point_Distance[i * k_nearest], max_dist);
         }
-    }
+    });
+    Epoch.leave(reader);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Get_Covered_Points(PointVector &Storage, const bool &get_covered_or_uncovered)
+void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
 {
     Storage.clear();
-    Get_Points_Covered(Root_Node, Storage, get_covered_or_uncovered);
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+        Frozen_Search_by_range(*frozen_tree, 0, frozen_tree->node_num, Box_of_Point, Storage);
+    else
+        Search_by_range(Root_Node, Box_of_Point, Storage);
+    Epoch.leave(reader);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Get_Points_Covered(KD_TREE_NODE *root, PointVector &Storage, const bool &get_covered_or_uncovered)
+void KD_TREE<PointType>::Radius_Search(const PointType &point, const float &radius, PointVector &Storage)
 {
-    if (root == nullptr)
-        return;
-    Push_Down(root);
-    if (!root->point_deleted && (root->point.covered==get_covered_or_uncovered))
-    {
+    Storage.clear();
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+        Frozen_Search_by_radius(*frozen_tree, 0, frozen_tree->node_num, point, radius * radius, Storage);
+    else
+        Search_by_radius(Root_Node, point, radius * radius, Storage);
+    Epoch.leave(reader);
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Box_Count(const BoxPointType &Box_of_Point)
+{
+    // Box_Search without copying the points
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    int count = frozen_tree != nullptr ? Frozen_Count_by_range(*frozen_tree, 0, frozen_tree->node_num, Box_of_Point) : Count_by_range(Root_Node, Box_of_Point);
+    Epoch.leave(reader);
+    return count;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Radius_Count(const PointType &point, const float &radius)
+{
+    // Radius_Search without copying the points
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    int count = frozen_tree != nullptr ? Frozen_Count_by_radius(*frozen_tree, 0, frozen_tree->node_num, point, radius * radius) : Count_by_radius(Root_Node, point, radius * radius);
+    Epoch.leave(reader);
+    return count;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::CollisionLineCheck(const PointType &point1, const PointType &point2, const float &radius)
+{
+    return Segment_Check(point1, point2, radius, nullptr);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::CollisionLineCheckExceptOrigin(const PointType &origin, const PointType &point1, const PointType &point2, const float &radius)
+{
+    // Points within radius of origin (e.g. the one the segment starts from) do not count as collisions
+    return Segment_Check(point1, point2, radius, &origin);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::CollisionLineCheck_Batch(const PointVector &Start_Points, const PointVector &End_Points, const float &radius, vector<int> &Collision, const bool &except_start)
+{
+    // Collision[i] is 1 if segment i (Start_Points[i] to End_Points[i]) passes within radius of a point,
+    // except_start: points within radius of the start of a segment do not count, as in CollisionLineCheckExceptOrigin
+    int segment_num = std::min(Start_Points.size(), End_Points.size());
+    Collision.resize(segment_num);
+    if (segment_num == 0)
+        return;
+    // One epoch for the whole batch, the workers run inside it
+    int reader = Epoch.enter();
+    int task_num = std::max(1, std::min(Worker_Pool.size(), segment_num / 64));
+    int chunk_size = (segment_num + task_num - 1) / task_num;
+    parallel_for(task_num, [&](int chunk)
+    {
+        int end = std::min(segment_num, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; i++)
+        {
+            RAY_QUERY segment;
+            float length = Segment_Query_Init(Start_Points[i], End_Points[i], radius, segment);
+            Collision[i] = Segment_Check_Dist(segment, length, except_start ? &Start_Points[i] : nullptr) ? 1 : 0;
+        }
+    });
+    Epoch.leave(reader);
+    return;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Segment_Check(const PointType &point1, const PointType &point2, const float &radius, const PointType *excluded)
+{
+    RAY_QUERY segment;
+    float length = Segment_Query_Init(point1, point2, radius, segment);
+    int reader = Epoch.enter();
+    bool collision = Segment_Check_Dist(segment, length, excluded);
+    Epoch.leave(reader);
+    return collision;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Segment_Query_Init(const PointType &point1, const PointType &point2, const float &radius, RAY_QUERY &segment)
+{
+    // The segment is the ray from point1 up to its length, a capsule query is a ray cast up to that length
+    PointType dir = point2;
+    dir.x = point2.x - point1.x;
+    dir.y = point2.y - point1.y;
+    dir.z = point2.z - point1.z;
+    if (Ray_Query_Init(point1, dir, radius, segment))
+        return std::sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+    // Degenerate segment, a sphere at point1
+    dir.x = 1.0f;
+    dir.y = 0.0f;
+    dir.z = 0.0f;
+    Ray_Query_Init(point1, dir, radius, segment);
+    return 0.0f;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Segment_Check_Dist(const RAY_QUERY &segment, const float &length, const PointType *excluded)
+{
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+        return Frozen_Ray_Entry(*frozen_tree, segment, 0, length) <= length && Frozen_Segment_Check(*frozen_tree, 0, frozen_tree->node_num, segment, length, excluded);
+    KD_TREE_NODE *root = Root_Node;
+    return root != nullptr && Ray_Node_Entry(segment, root, length) <= length && Segment_Check_Recursive(root, segment, length, excluded);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Ray_Cast(const PointType &pt, const PointType &dir, const float& radius, PointType& hit_point, const float& max_dist)
+{
+    // hit_point is where the ray first comes within radius of a point, or its end at max_dist if it does not
+    RAY_QUERY ray;
+    if (!Ray_Query_Init(pt, dir, radius, ray))
+    {
+        hit_point = pt;
+        return CollisionCheck(pt, radius);
+    }
+    int reader = Epoch.enter();
+    float hit_dist = Ray_Cast_Dist(ray, max_dist);
+    Epoch.leave(reader);
+    bool hit = hit_dist <= max_dist;
+    float t = hit ? hit_dist : max_dist;
+    hit_point = pt;
+    hit_point.x = pt.x + ray.dir[0] * t;
+    hit_point.y = pt.y + ray.dir[1] * t;
+    hit_point.z = pt.z + ray.dir[2] * t;
+    return hit;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Ray_Cast_Batch(const PointType &pt, const PointVector &Directions, const float &radius, PointVector &Hit_Points, vector<float> &Hit_Distance, const float &max_dist)
+{
+    // One Ray_Cast from pt per direction, Hit_Distance is INFINITY for the rays that hit nothing
+    int ray_num = Directions.size();
+    Hit_Points.resize(ray_num);
+    Hit_Distance.resize(ray_num);
+    if (ray_num == 0)
+        return;
+    // One epoch for the whole batch, the workers run inside it
+    int reader = Epoch.enter();
+    int task_num = std::max(1, std::min(Worker_Pool.size(), ray_num / 64));
+    int chunk_size = (ray_num + task_num - 1) / task_num;
+    parallel_for(task_num, [&](int chunk)
+    {
+        int end = std::min(ray_num, (chunk + 1) * chunk_size);
+        for (int i = chunk * chunk_size; i < end; i++)
+        {
+            RAY_QUERY ray;
+            Hit_Points[i] = pt;
+            if (!Ray_Query_Init(pt, Directions[i], radius, ray))
+            {
+                Hit_Distance[i] = INFINITY;
+                continue;
+            }
+            float hit_dist = Ray_Cast_Dist(ray, max_dist);
+            Hit_Distance[i] = hit_dist <= max_dist ? hit_dist : INFINITY;
+            float t = std::min(hit_dist, max_dist);
+            Hit_Points[i].x = pt.x + ray.dir[0] * t;
+            Hit_Points[i].y = pt.y + ray.dir[1] * t;
+            Hit_Points[i].z = pt.z + ray.dir[2] * t;
+        }
+    });
+    Epoch.leave(reader);
+    return;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Ray_Query_Init(const PointType &pt, const PointType &dir, const float &radius, RAY_QUERY &ray)
+{
+    float dir_length = std::sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+    if (dir_length < EPSS)
+        return false;
+    const float origin[3] = {pt.x, pt.y, pt.z};
+    const float unit[3] = {dir.x / dir_length, dir.y / dir_length, dir.z / dir_length};
+    for (int k = 0; k < 3; k++)
+    {
+        ray.origin[k] = origin[k];
+        ray.dir[k] = unit[k];
+        ray.inv_dir[k] = 1.0f / unit[k];
+    }
+    ray.radius = radius;
+    ray.radius_sq = radius * radius;
+    return true;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Ray_Cast_Dist(const RAY_QUERY &ray, const float &max_dist)
+{
+    // Distance along the ray of the first hit, INFINITY if there is none up to max_dist
+    float hit_dist = INFINITY;
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+    {
+        if (Frozen_Ray_Entry(*frozen_tree, ray, 0, max_dist) <= max_dist)
+            Frozen_Ray_Cast(*frozen_tree, 0, frozen_tree->node_num, ray, max_dist, hit_dist);
+    }
+    else
+    {
+        KD_TREE_NODE *root = Root_Node;
+        if (root != nullptr && Ray_Node_Entry(ray, root, max_dist) <= max_dist)
+            Ray_Cast_Recursive(root, ray, max_dist, hit_dist);
+    }
+    return hit_dist;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Ray_Box_Entry(const RAY_QUERY &ray, const float *box_min, const float *box_max, const float &t_max)
+{
+    // Slab test against the box inflated by the radius, entry distance in [0, t_max] or INFINITY
+    float t_enter = 0.0f, t_exit = t_max;
+    for (int k = 0; k < 3; k++)
+    {
+        float low = box_min[k] - ray.radius, high = box_max[k] + ray.radius;
+        if (low > high)
+            return INFINITY;
+        if (ray.dir[k] == 0.0f)
+        {
+            if (ray.origin[k] < low || ray.origin[k] > high)
+                return INFINITY;
+            continue;
+        }
+        float t0 = (low - ray.origin[k]) * ray.inv_dir[k];
+        float t1 = (high - ray.origin[k]) * ray.inv_dir[k];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        t_enter = std::max(t_enter, t0);
+        t_exit = std::min(t_exit, t1);
+        if (t_enter > t_exit)
+            return INFINITY;
+    }
+    return t_enter;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Ray_Node_Entry(const RAY_QUERY &ray, KD_TREE_NODE *node, const float &t_max)
+{
+    if (node == nullptr)
+        return INFINITY;
+    const float box_min[3] = {node->node_range_x[0], node->node_range_y[0], node->node_range_z[0]};
+    const float box_max[3] = {node->node_range_x[1], node->node_range_y[1], node->node_range_z[1]};
+    return Ray_Box_Entry(ray, box_min, box_max, t_max);
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Frozen_Ray_Entry(const FROZEN_TREE &frozen_tree, const RAY_QUERY &ray, const int &p, const float &t_max)
+{
+    const float box_min[3] = {frozen_tree.range_min[0][p], frozen_tree.range_min[1][p], frozen_tree.range_min[2][p]};
+    const float box_max[3] = {frozen_tree.range_max[0][p], frozen_tree.range_max[1][p], frozen_tree.range_max[2][p]};
+    return Ray_Box_Entry(ray, box_min, box_max, t_max);
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Ray_Point_Entry(const RAY_QUERY &ray, const PointType &point)
+{
+    // Distance along the ray where it enters the sphere of radius around point, INFINITY if it never does
+    float v[3] = {point.x - ray.origin[0], point.y - ray.origin[1], point.z - ray.origin[2]};
+    float v_sq = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    if (v_sq <= ray.radius_sq)
+        return 0.0f;
+    float t = v[0] * ray.dir[0] + v[1] * ray.dir[1] + v[2] * ray.dir[2];
+    if (t < 0.0f)
+        return INFINITY;
+    // From the perpendicular itself, v_sq - t * t cancels badly far along the ray
+    float w[3] = {v[0] - t * ray.dir[0], v[1] - t * ray.dir[1], v[2] - t * ray.dir[2]};
+    float h_sq = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+    if (h_sq > ray.radius_sq)
+        return INFINITY;
+    return t - std::sqrt(ray.radius_sq - h_sq);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Ray_Cast_Recursive(KD_TREE_NODE *root, const RAY_QUERY &ray, const float &max_dist, float &hit_dist, const LAZY_LABELS &father_labels)
+{
+    // The ray is known to enter the box of root before the current hit
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return;
+    if (!labels.point_deleted)
+    {
+        float t = Ray_Point_Entry(ray, root->point);
+        if (t <= max_dist && t < hit_dist)
+            hit_dist = t;
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left.load_acquire());
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+        {
+            if (Slot_Deleted(bucket, i, slot_labels))
+                continue;
+            float t = Ray_Point_Entry(ray, bucket->points[i]);
+            if (t <= max_dist && t < hit_dist)
+                hit_dist = t;
+        }
+        return;
+    }
+    // Front to back, the farther son is skipped once the hit is closer than its box
+    KD_TREE_NODE *sons[2] = {root->left_son_ptr, root->right_son_ptr};
+    bool push_down[2] = {root->need_push_down_to_left.load_acquire(), root->need_push_down_to_right.load_acquire()};
+    float bound = std::min(hit_dist, max_dist);
+    float entry[2] = {Ray_Node_Entry(ray, sons[0], bound), Ray_Node_Entry(ray, sons[1], bound)};
+    int first = entry[1] < entry[0] ? 1 : 0;
+    for (int i = 0; i < 2; i++)
+    {
+        int s = i == 0 ? first : 1 - first;
+        if (entry[s] <= std::min(hit_dist, max_dist))
+            Ray_Cast_Recursive(sons[s], ray, max_dist, hit_dist, Son_Labels(labels, push_down[s]));
+    }
+    return;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Segment_Check_Recursive(KD_TREE_NODE *root, const RAY_QUERY &segment, const float &length, const PointType *excluded, const LAZY_LABELS &father_labels)
+{
+    // The segment is known to pass through the box of root inflated by the radius
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return false;
+    if (!labels.point_deleted && Ray_Point_Entry(segment, root->point) <= length && (excluded == nullptr || calc_dist(*excluded, root->point) > segment.radius_sq))
+        return true;
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left.load_acquire());
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+            if (!Slot_Deleted(bucket, i, slot_labels) && Ray_Point_Entry(segment, bucket->points[i]) <= length && (excluded == nullptr || calc_dist(*excluded, bucket->points[i]) > segment.radius_sq))
+                return true;
+        return false;
+    }
+    // Any hit ends the query, the son whose box is entered first is the likelier one
+    KD_TREE_NODE *sons[2] = {root->left_son_ptr, root->right_son_ptr};
+    bool push_down[2] = {root->need_push_down_to_left.load_acquire(), root->need_push_down_to_right.load_acquire()};
+    float entry[2] = {Ray_Node_Entry(segment, sons[0], length), Ray_Node_Entry(segment, sons[1], length)};
+    int first = entry[1] < entry[0] ? 1 : 0;
+    for (int i = 0; i < 2; i++)
+    {
+        int s = i == 0 ? first : 1 - first;
+        if (entry[s] <= length && Segment_Check_Recursive(sons[s], segment, length, excluded, Son_Labels(labels, push_down[s])))
+            return true;
+    }
+    return false;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::CollisionCheck(const PointType &point, const float &radius)
+{
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    bool collision = frozen_tree != nullptr ? Frozen_Collision_Check(*frozen_tree, 0, frozen_tree->node_num, point, radius * radius) : CollisionCheckRecursive(Root_Node, point, radius * radius);
+    Epoch.leave(reader);
+    return collision;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Add_Points(const PointVector &PointToAdd, const bool &downsample_on)
+{
+    Unfreeze();
+    PointType mid_point;
+    int tmp_counter = 0;
+
+    // If not built, Build first
+    if (Root_Node == nullptr)
+    {
+        PointVector PointToBuild;
+        if (downsample_on) //Input points for Build is also modified to use grid-aligned Downsampling
+            Voxelize_Points(PointToAdd, PointToBuild);
+        else
+            PointToBuild = PointToAdd;
+        Build(PointToBuild);
+        if (downsample_on)
+            Voxel_Occupancy_Init();
+        return 0;
+    }
+    if (downsample_on)
+        Voxel_Occupancy_Init();
+
+    // If built, Add points
+    for (size_t i = 0; i < PointToAdd.size(); i++)
+    {
+        if (downsample_on)
+        {
+            int x_key = int(PointToAdd[i].x * inv_downsample_size) - std::signbit(PointToAdd[i].x);
+            int y_key = int(PointToAdd[i].y * inv_downsample_size) - std::signbit(PointToAdd[i].y);
+            int z_key = int(PointToAdd[i].z * inv_downsample_size) - std::signbit(PointToAdd[i].z);
+
+            mid_point.x = (x_key + 0.5) * downsample_size;
+            mid_point.y = (y_key + 0.5) * downsample_size;
+            mid_point.z = (z_key + 0.5) * downsample_size;
+            
+            if (Voxel_Occupancy.find(voxel_key(mid_point)) != Voxel_Occupancy.end()) // a point already exists in the voxel grid, do nothing
+                continue;
+            else // add a point (not raw, but as the mid point (centroid) of voxel grid)
+            {
+                int slot_id = Rebuild_Slot_Of(Root_Node);
+                if (slot_id < 0)
+                {
+                    Add_by_point(&Root_Node, mid_point, true, Root_Node->division_axis);
+                    tmp_counter++;
+                }
+                else
+                {
+                    Operation_Logger_Type operation;
+                    operation.point = mid_point;
+                    operation.op = ADD_POINT;
+                    pthread_mutex_lock(&working_flag_mutex);
+                    Add_by_point(&Root_Node, mid_point, false, Root_Node->division_axis);
+                    tmp_counter++;
+                    if (Rebuild_Slots[slot_id].rebuild_flag)
+                    {
+                        Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
+                    }
+                    pthread_mutex_unlock(&working_flag_mutex);
+                }
+            }
+        }
+        else
+        {
+            int slot_id = Rebuild_Slot_Of(Root_Node);
+            if (slot_id < 0)
+            {
+                Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);
+            }
+            else
+            {
+                Operation_Logger_Type operation;
+                operation.point = PointToAdd[i];
+                operation.op = ADD_POINT;
+                pthread_mutex_lock(&working_flag_mutex);
+                Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
+                if (Rebuild_Slots[slot_id].rebuild_flag)
+                {
+                    Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
+                }
+                pthread_mutex_unlock(&working_flag_mutex);
+            }
+        }
+    }
+    return tmp_counter;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Add_Point_Boxes(const vector<BoxPointType> &BoxPoints)
+{
+    Unfreeze();
+    for (size_t i = 0; i < BoxPoints.size(); i++)
+    {
+        int slot_id = Rebuild_Slot_Of(Root_Node);
+        if (slot_id < 0)
+        {
+            Add_by_range(&Root_Node, BoxPoints[i], true);
+        }
+        else
+        {
+            Operation_Logger_Type operation;
+            operation.boxpoint = BoxPoints[i];
+            operation.op = ADD_BOX;
+            pthread_mutex_lock(&working_flag_mutex);
+            Add_by_range(&Root_Node, BoxPoints[i], false);
+            if (Rebuild_Slots[slot_id].rebuild_flag)
+            {
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Get_Covered_Points(PointVector &Storage, const bool &get_covered_or_uncovered)
+{
+    Storage.clear();
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+        Frozen_Get_Covered(*frozen_tree, 0, frozen_tree->node_num, Storage, get_covered_or_uncovered);
+    else
+        Get_Points_Covered(Root_Node, Storage, get_covered_or_uncovered);
+    Epoch.leave(reader);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Get_Points_Covered(KD_TREE_NODE *root, PointVector &Storage, const bool &get_covered_or_uncovered, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return;
+    // Subtrees without a valid point of the wanted kind are skipped
+    int valid_num, covered_num;
+    Lazy_Counts(root, father_labels, valid_num, covered_num);
+    if ((get_covered_or_uncovered ? covered_num : valid_num - covered_num) == 0)
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (!labels.point_deleted && (Traits::covered(root->point) == get_covered_or_uncovered))
+    {
         Storage.push_back(root->point);
     }
-    Get_Points_Covered(root->left_son_ptr, Storage, get_covered_or_uncovered);
-    Get_Points_Covered(root->right_son_ptr, Storage, get_covered_or_uncovered);
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+            if (!Slot_Deleted(bucket, i, slot_labels) && Traits::covered(bucket->points[i]) == get_covered_or_uncovered)
+                Storage.push_back(bucket->points[i]);
+    }
+    Get_Points_Covered(root->left_son_ptr, Storage, get_covered_or_uncovered, Son_Labels(labels, root->need_push_down_to_left));
+    Get_Points_Covered(root->right_son_ptr, Storage, get_covered_or_uncovered, Son_Labels(labels, root->need_push_down_to_right));
+    return;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::covered_ratio()
+{
+    // Covered share of the valid points, 0 for an empty tree
+    int valid_num = 0, covered_num = 0;
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    KD_TREE_NODE *root = Root_Node;
+    if (frozen_tree != nullptr)
+    {
+        valid_num = frozen_tree->node_num;
+        covered_num = frozen_tree->covered_num[0];
+    }
+    else if (root != nullptr)
+        Lazy_Counts(root, LAZY_LABELS(), valid_num, covered_num);
+    Epoch.leave(reader);
+    return valid_num > 0 ? float(covered_num) / valid_num : 0.0f;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Box_Covered_Count(const BoxPointType &Box_of_Point, int &covered_num, int &uncovered_num)
+{
+    // Valid points in the box (half-open as Box_Search), subtrees inside the box are counted from their counters
+    covered_num = 0;
+    uncovered_num = 0;
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    if (frozen_tree != nullptr)
+        Frozen_Covered_Count(*frozen_tree, 0, frozen_tree->node_num, Box_of_Point, covered_num, uncovered_num);
+    else
+        Covered_Count_by_range(Root_Node, Box_of_Point, covered_num, uncovered_num);
+    Epoch.leave(reader);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Covered_Count_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, int &covered_num, int &uncovered_num, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return;
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return;
+    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+    {
+        int valid_num, valid_covered_num;
+        Lazy_Counts(root, father_labels, valid_num, valid_covered_num);
+        covered_num += valid_covered_num;
+        uncovered_num += valid_num - valid_covered_num;
+        return;
+    }
+    if (!labels.point_deleted && boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+    {
+        if (Traits::covered(root->point))
+            covered_num++;
+        else
+            uncovered_num++;
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+        {
+            if (Slot_Deleted(bucket, i, slot_labels) || !(boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i]))
+                continue;
+            if (Traits::covered(bucket->points[i]))
+                covered_num++;
+            else
+                uncovered_num++;
+        }
+    }
+    Covered_Count_by_range(root->left_son_ptr, boxpoint, covered_num, uncovered_num, Son_Labels(labels, root->need_push_down_to_left));
+    Covered_Count_by_range(root->right_son_ptr, boxpoint, covered_num, uncovered_num, Son_Labels(labels, root->need_push_down_to_right));
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Set_Covered_by_point(KD_TREE_NODE **root, const PointType &point)
+{
+    // Left sons are < and right sons are >= the division value (Split_Storage, Add_by_point),
+    // so a point only has to be followed into the side(s) within EPSS of the division value
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return -1;
+    Push_Down(*root);
+    if ((point.x < (*root)->node_range_x[0] - EPSS) || (point.x > (*root)->node_range_x[1] + EPSS))
+        return -1;
+    if ((point.y < (*root)->node_range_y[0] - EPSS) || (point.y > (*root)->node_range_y[1] + EPSS))
+        return -1;
+    if ((point.z < (*root)->node_range_z[0] - EPSS) || (point.z > (*root)->node_range_z[1] + EPSS))
+        return -1;
+    (*root)->working_flag = true;
+    if (same_point((*root)->point, point) && !(*root)->point_deleted)
+    {
+        Traits::set_covered((*root)->point, true);
+        Update(*root);
+        (*root)->working_flag = false;
+        return 0;
+    }
+    LEAF_BUCKET *bucket = (*root)->bucket;
+    if (bucket != nullptr)
+    {
+        int point_num = bucket->point_num.load(std::memory_order_relaxed);
+        int retval = -1;
+        for (int i = 0; i < point_num && retval != 0; i++)
+        {
+            if (!bucket->point_deleted[i] && same_point(bucket->points[i], point))
+            {
+                Traits::set_covered(bucket->points[i], true);
+                Update(*root);
+                retval = 0;
+            }
+        }
+        (*root)->working_flag = false;
+        return retval;
+    }
+    float point_value = (*root)->division_axis == 0 ? point.x : ((*root)->division_axis == 1 ? point.y : point.z);
+    float division_value = (*root)->division_axis == 0 ? (*root)->point.x : ((*root)->division_axis == 1 ? (*root)->point.y : (*root)->point.z);
+    Operation_Logger_Type covered_log;
+    covered_log.op = SET_COVERED;
+    covered_log.point = point;
+    int retval = -1;
+    if (point_value < division_value + EPSS)
+    {
+        int slot_id = Rebuild_Slot_Of((*root)->left_son_ptr);
+        if (slot_id < 0)
+        {
+            retval = Set_Covered_by_point(&(*root)->left_son_ptr, point);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            retval = Set_Covered_by_point(&(*root)->left_son_ptr, point);
+            if (Rebuild_Slots[slot_id].rebuild_flag)
+            {
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(covered_log);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    if (retval != 0 && point_value > division_value - EPSS)
+    {
+        int slot_id = Rebuild_Slot_Of((*root)->right_son_ptr);
+        if (slot_id < 0)
+        {
+            retval = Set_Covered_by_point(&(*root)->right_son_ptr, point);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            retval = Set_Covered_by_point(&(*root)->right_son_ptr, point);
+            if (Rebuild_Slots[slot_id].rebuild_flag)
+            {
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(covered_log);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    // Covered counts of the path to the marked point
+    if (retval == 0)
+        Update(*root);
+    (*root)->working_flag = false;
+    return retval;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Set_Covered_by_points(KD_TREE_NODE **root, const PointVector &PointsCovered, const int &depth)
+{
+    // Batched Set_Covered_by_point: Covered_Query_Stack[depth] holds the indices of the points that reach this node
+    if ((*root) == nullptr || (*root)->tree_deleted || Covered_Query_Stack[depth].empty())
+        return;
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    if (int(Covered_Query_Stack.size()) < depth + 2)
+        Covered_Query_Stack.resize(depth + 2);
+    bool root_valid = !(*root)->point_deleted;
+    LEAF_BUCKET *bucket = (*root)->bucket;
+    if (bucket != nullptr)
+    {
+        // A leaf bucket, each point is looked for among the point of the leaf and the slots
+        const vector<int> &queries = Covered_Query_Stack[depth];
+        int point_num = bucket->point_num.load(std::memory_order_relaxed);
+        for (size_t q = 0; q < queries.size(); q++)
+        {
+            const PointType &point = PointsCovered[queries[q]];
+            if (root_valid && same_point((*root)->point, point))
+            {
+                Traits::set_covered((*root)->point, true);
+                continue;
+            }
+            for (int i = 0; i < point_num; i++)
+            {
+                if (!bucket->point_deleted[i] && same_point(bucket->points[i], point))
+                {
+                    Traits::set_covered(bucket->points[i], true);
+                    break;
+                }
+            }
+        }
+        Update(*root);
+        (*root)->working_flag = false;
+        return;
+    }
+    int axis = (*root)->division_axis;
+    float division_value = axis == 0 ? (*root)->point.x : (axis == 1 ? (*root)->point.y : (*root)->point.z);
+    for (int son = 0; son < 2; son++)
+    {
+        KD_TREE_NODE **son_ptr = (son == 0) ? &(*root)->left_son_ptr : &(*root)->right_son_ptr;
+        // Deeper levels may grow Covered_Query_Stack, so the references are taken again for each son
+        const vector<int> &queries = Covered_Query_Stack[depth];
+        vector<int> &son_queries = Covered_Query_Stack[depth + 1];
+        son_queries.clear();
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            const PointType &point = PointsCovered[queries[i]];
+            if ((point.x < (*root)->node_range_x[0] - EPSS) || (point.x > (*root)->node_range_x[1] + EPSS))
+                continue;
+            if ((point.y < (*root)->node_range_y[0] - EPSS) || (point.y > (*root)->node_range_y[1] + EPSS))
+                continue;
+            if ((point.z < (*root)->node_range_z[0] - EPSS) || (point.z > (*root)->node_range_z[1] + EPSS))
+                continue;
+            if (root_valid && same_point((*root)->point, point))
+            {
+                Traits::set_covered((*root)->point, true);
+                continue;
+            }
+            float point_value = axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+            if ((son == 0 && point_value < division_value + EPSS) || (son == 1 && point_value > division_value - EPSS))
+                son_queries.push_back(queries[i]);
+        }
+        if (son_queries.empty() || *son_ptr == nullptr)
+            continue;
+        int slot_id = Rebuild_Slot_Of(*son_ptr);
+        if (slot_id < 0)
+        {
+            Set_Covered_by_points(son_ptr, PointsCovered, depth + 1);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            if (Rebuild_Slots[slot_id].rebuild_flag)
+            {
+                Operation_Logger_Type covered_log;
+                covered_log.op = SET_COVERED;
+                for (size_t i = 0; i < son_queries.size(); i++)
+                {
+                    covered_log.point = PointsCovered[son_queries[i]];
+                    Rebuild_Slots[slot_id].Rebuild_Logger.push(covered_log);
+                }
+            }
+            Set_Covered_by_points(son_ptr, PointsCovered, depth + 1);
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    (*root)->working_flag = false;
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Set_Covered_Points(const PointVector &PointsCovered)
+{
+    // Point types without coverage storage have nothing to mark
+    if (!Traits::has_coverage)
+        return;
+    Unfreeze();
+    if (Covered_Query_Stack.empty())
+        Covered_Query_Stack.resize(1);
+    Covered_Query_Stack[0].clear();
+    for (size_t i = 0; i < PointsCovered.size(); i++)
+    {
+        if (Traits::covered(PointsCovered[i])) continue;
+        Covered_Query_Stack[0].push_back(i);
+    }
+    int slot_id = Rebuild_Slot_Of(Root_Node);
+    if (slot_id < 0)
+    {
+        Set_Covered_by_points(&Root_Node, PointsCovered, 0);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        if (Rebuild_Slots[slot_id].rebuild_flag)
+        {
+            Operation_Logger_Type covered_log;
+            covered_log.op = SET_COVERED;
+            for (size_t i = 0; i < Covered_Query_Stack[0].size(); i++)
+            {
+                covered_log.point = PointsCovered[Covered_Query_Stack[0][i]];
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(covered_log);
+            }
+        }
+        Set_Covered_by_points(&Root_Node, PointsCovered, 0);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
     return;
 }
 
 template <typename PointType>
-int KD_TREE<PointType>::Set_Covered_by_point(KD_TREE_NODE *root, const PointType &point)
+int KD_TREE<PointType>::Set_Covered_By_Sensor(const Eigen::Matrix4f &pose, const float &fov_h, const float &fov_v, const float &max_range)
+{
+    // Marks every valid point seen by a sensor at pose (sensor to tree frame, looking along its x axis),
+    // fov_h and fov_v are full angles in radians. Returns the number of points that became covered
+    if (!Traits::has_coverage)
+        return 0;
+    Unfreeze();
+    if (Root_Node == nullptr)
+        return 0;
+    SENSOR_QUERY sensor;
+    for (int i = 0; i < 3; i++)
+    {
+        sensor.origin[i] = pose(i, 3);
+        for (int j = 0; j < 3; j++)
+            sensor.rotation[i][j] = pose(j, i);
+    }
+    sensor.cos_h = std::cos(fov_h * 0.5f);
+    sensor.sin_h = std::sin(fov_h * 0.5f);
+    sensor.wedge_convex = fov_h < M_PI;
+    sensor.wedge_full = fov_h >= 2 * M_PI;
+    sensor.cone_limited = fov_v < M_PI;
+    sensor.tan_v = sensor.cone_limited ? std::tan(fov_v * 0.5f) : INFINITY;
+    sensor.max_range_sq = max_range * max_range;
+    // Nodes above split_depth are marked here, the subtrees below are marked on the workers. Subtrees of
+    // the rebuild slots are left to the end, marked with the rebuild thread kept out and logged for it
+    int split_depth = 0;
+    if (Root_Node->TreeSize >= Parallel_Point_Num && Worker_Pool.size() > 1)
+        split_depth = Build_Fork_Depth() + 2;
+    vector<KD_TREE_NODE **> tasks;
+    SENSOR_TASK top;
+    int covered_num = Sensor_Split(&Root_Node, sensor, split_depth, tasks, top);
+    int task_num = tasks.size();
+    vector<SENSOR_TASK> task_nodes(task_num);
+    vector<int> task_covered(task_num, 0);
+    parallel_for(task_num, [&](int i)
+    {
+        task_covered[i] = Set_Covered_by_sensor(*tasks[i], sensor, &task_nodes[i], nullptr);
+    });
+    // Every covered count is updated here, with the rebuild thread kept out
+    pthread_mutex_lock(&working_flag_mutex);
+    vector<KD_TREE_NODE **> changed;
+    for (int i = 0; i < task_num; i++)
+    {
+        covered_num += task_covered[i];
+        for (size_t j = 0; j < task_nodes[i].updates.size(); j++)
+            Update(task_nodes[i].updates[j]);
+        if (task_covered[i] > 0)
+            changed.push_back(tasks[i]);
+        top.deferred.insert(top.deferred.end(), task_nodes[i].deferred.begin(), task_nodes[i].deferred.end());
+    }
+    for (size_t i = 0; i < top.updates.size(); i++)
+        Update(top.updates[i]);
+    for (size_t i = 0; i < top.deferred.size(); i++)
+    {
+        // Read again, the rebuild thread may have swapped the subtree in meanwhile
+        KD_TREE_NODE *root = *top.deferred[i];
+        int slot_id = Rebuild_Slot_Of(root);
+        MANUAL_Q *log = (slot_id >= 0 && Rebuild_Slots[slot_id].rebuild_flag) ? &Rebuild_Slots[slot_id].Rebuild_Logger : nullptr;
+        int deferred_covered = Set_Covered_by_sensor(root, sensor, nullptr, log);
+        covered_num += deferred_covered;
+        if (deferred_covered > 0)
+            changed.push_back(top.deferred[i]);
+    }
+    // Paths above the subtrees marked apart, their nodes have been pushed down already
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        for (KD_TREE_NODE *father = (*changed[i])->father_ptr; father != nullptr && father != STATIC_ROOT_NODE; father = father->father_ptr)
+            Update(father);
+    }
+    for (size_t i = 0; i < top.updates.size(); i++)
+        top.updates[i]->working_flag = false;
+    for (int i = 0; i < task_num; i++)
+    {
+        for (size_t j = 0; j < task_nodes[i].updates.size(); j++)
+            task_nodes[i].updates[j]->working_flag = false;
+    }
+    pthread_mutex_unlock(&working_flag_mutex);
+    return covered_num;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Sensor_Split(KD_TREE_NODE **link, const SENSOR_QUERY &sensor, const int &depth, vector<KD_TREE_NODE **> &tasks, SENSOR_TASK &top)
 {
+    // Marks the nodes above depth and collects the subtrees at depth as tasks, the caller updates top
+    KD_TREE_NODE *root = *link;
     if (root == nullptr)
-        return -1;
-    Push_Down(root);
-    if (same_point(root->point, point) && !root->point_deleted)
+        return 0;
+    if (Rebuild_Slot_Of(root) >= 0)
+    {
+        top.deferred.push_back(link);
+        return 0;
+    }
+    if (depth == 0)
     {
-        root->point.covered = true;
+        tasks.push_back(link);
+        return 0;
+    }
+    if (root->tree_deleted || Sensor_Box_Culled(sensor, root))
         return 0;
+    root->working_flag = true;
+    Push_Down(root);
+    int covered_num = 0;
+    if (!root->point_deleted && !Traits::covered(root->point) && Sensor_Point_Visible(sensor, root->point))
+    {
+        Traits::set_covered(root->point, true);
+        covered_num++;
     }
+    covered_num += Sensor_Cover_Bucket(root, sensor, nullptr);
+    covered_num += Sensor_Split(&root->left_son_ptr, sensor, depth - 1, tasks, top);
+    covered_num += Sensor_Split(&root->right_son_ptr, sensor, depth - 1, tasks, top);
+    if (covered_num > 0)
+        top.updates.push_back(root);
     else
+        root->working_flag = false;
+    return covered_num;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Set_Covered_by_sensor(KD_TREE_NODE *root, const SENSOR_QUERY &sensor, SENSOR_TASK *task, MANUAL_Q *log)
+{
+    // task: run on a worker, the subtrees of the rebuild slots and the updates are left to the calling thread
+    // log: the rebuild of this subtree is running, newly covered points are logged for it
+    if (root == nullptr || root->tree_deleted || Sensor_Box_Culled(sensor, root))
+        return 0;
+    if (task != nullptr)
+        root->working_flag = true;
+    Push_Down(root);
+    int covered_num = 0;
+    if (!root->point_deleted && !Traits::covered(root->point) && Sensor_Point_Visible(sensor, root->point))
     {
-        // if ((root->division_axis == 0 && point.x < root->point.x) || (root->division_axis == 1 && point.y < root->point.y) || (root->division_axis == 2 && point.z < root->point.z))
-        // {
-        //     if (Set_Covered_by_point(root->left_son_ptr, point) == 0)
-        //         return 0;
-        // }
-        // else
-        // {            
-        //     if (Set_Covered_by_point(root->right_son_ptr, point) == 0)
-        //         return 0;
-        // }
-        if (Set_Covered_by_point(root->left_son_ptr, point) == 0)
-            return 0;
-        else if (Set_Covered_by_point(root->right_son_ptr, point) == 0)
-            return 0;
+        Traits::set_covered(root->point, true);
+        covered_num++;
+        if (log != nullptr)
+        {
+            Operation_Logger_Type covered_log;
+            covered_log.op = SET_COVERED;
+            covered_log.point = root->point;
+            log->push(covered_log);
+        }
+    }
+    covered_num += Sensor_Cover_Bucket(root, sensor, log);
+    KD_TREE_NODE **links[2] = {&root->left_son_ptr, &root->right_son_ptr};
+    for (int s = 0; s < 2; s++)
+    {
+        if (task != nullptr && Rebuild_Slot_Of(*links[s]) >= 0)
+        {
+            task->deferred.push_back(links[s]);
+            continue;
+        }
+        covered_num += Set_Covered_by_sensor(*links[s], sensor, task, log);
     }
-    return -1;
+    if (covered_num > 0 && task != nullptr)
+        task->updates.push_back(root);
+    else if (covered_num > 0)
+        Update(root);
+    else if (task != nullptr)
+        root->working_flag = false;
+    return covered_num;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Set_Covered_Points(const PointVector &PointsCovered)
+int KD_TREE<PointType>::Sensor_Cover_Bucket(KD_TREE_NODE *leaf, const SENSOR_QUERY &sensor, MANUAL_Q *log)
 {
-    for (size_t i = 0; i < PointsCovered.size(); i++)
+    // Marks the valid points seen in the bucket of leaf, pushed down already, and returns how many
+    LEAF_BUCKET *bucket = leaf->bucket;
+    if (bucket == nullptr)
+        return 0;
+    int covered_num = 0;
+    int point_num = bucket->point_num.load(std::memory_order_relaxed);
+    for (int i = 0; i < point_num; i++)
     {
-        if (PointsCovered[i].covered) continue;
-        Set_Covered_by_point(Root_Node, PointsCovered[i]);
+        if (bucket->point_deleted[i] || Traits::covered(bucket->points[i]) || !Sensor_Point_Visible(sensor, bucket->points[i]))
+            continue;
+        Traits::set_covered(bucket->points[i], true);
+        covered_num++;
+        if (log != nullptr)
+        {
+            Operation_Logger_Type covered_log;
+            covered_log.op = SET_COVERED;
+            covered_log.point = bucket->points[i];
+            log->push(covered_log);
+        }
     }
-    return;
+    return covered_num;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Sensor_Point_Visible(const SENSOR_QUERY &sensor, const PointType &point)
+{
+    const float v[3] = {point.x - sensor.origin[0], point.y - sensor.origin[1], point.z - sensor.origin[2]};
+    if (v[0] * v[0] + v[1] * v[1] + v[2] * v[2] > sensor.max_range_sq)
+        return false;
+    float q[3];
+    for (int i = 0; i < 3; i++)
+        q[i] = sensor.rotation[i][0] * v[0] + sensor.rotation[i][1] * v[1] + sensor.rotation[i][2] * v[2];
+    // Outside the left and the right boundary planes of the horizontal wedge
+    bool out_left = q[1] * sensor.cos_h - q[0] * sensor.sin_h > 0.0f;
+    bool out_right = -q[1] * sensor.cos_h - q[0] * sensor.sin_h > 0.0f;
+    if (!sensor.wedge_full && (sensor.wedge_convex ? (out_left || out_right) : (out_left && out_right)))
+        return false;
+    return !sensor.cone_limited || std::fabs(q[2]) <= sensor.tan_v * std::sqrt(q[0] * q[0] + q[1] * q[1]);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Sensor_Box_Culled(const SENSOR_QUERY &sensor, KD_TREE_NODE *node)
+{
+    // Conservative: the box is culled beyond max_range, or when all its corners lie in one region outside
+    // the field of view that is convex (so it holds the whole box)
+    const float box_min[3] = {node->node_range_x[0], node->node_range_y[0], node->node_range_z[0]};
+    const float box_max[3] = {node->node_range_x[1], node->node_range_y[1], node->node_range_z[1]};
+    float min_dist = 0.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        float d = std::max(std::max(box_min[i] - sensor.origin[i], sensor.origin[i] - box_max[i]), 0.0f);
+        min_dist += d * d;
+    }
+    if (min_dist > sensor.max_range_sq)
+        return true;
+    if (sensor.wedge_full && !sensor.cone_limited)
+        return false;
+    bool all_left = true, all_right = true, all_above = true, all_below = true;
+    for (int c = 0; c < 8; c++)
+    {
+        const float v[3] = {((c & 1) ? box_max[0] : box_min[0]) - sensor.origin[0],
+                            ((c & 2) ? box_max[1] : box_min[1]) - sensor.origin[1],
+                            ((c & 4) ? box_max[2] : box_min[2]) - sensor.origin[2]};
+        float q[3];
+        for (int i = 0; i < 3; i++)
+            q[i] = sensor.rotation[i][0] * v[0] + sensor.rotation[i][1] * v[1] + sensor.rotation[i][2] * v[2];
+        all_left = all_left && q[1] * sensor.cos_h - q[0] * sensor.sin_h > 0.0f;
+        all_right = all_right && -q[1] * sensor.cos_h - q[0] * sensor.sin_h > 0.0f;
+        float cone = sensor.tan_v * std::sqrt(q[0] * q[0] + q[1] * q[1]);
+        all_above = all_above && q[2] > cone;
+        all_below = all_below && -q[2] > cone;
+    }
+    if (!sensor.wedge_full && (sensor.wedge_convex ? (all_left || all_right) : (all_left && all_right)))
+        return true;
+    return sensor.cone_limited && (all_above || all_below);
 }
 
 template <typename PointType>
 void KD_TREE<PointType>::Delete_Points(const PointVector &PointToDel)
 {
+    Unfreeze();
     for (size_t i = 0; i < PointToDel.size(); i++)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        int slot_id = Rebuild_Slot_Of(Root_Node);
+        if (slot_id < 0)
         {
             Delete_by_point(&Root_Node, PointToDel[i], true);
         }
@@ -794,11 +2013,9 @@ void KD_TREE<PointType>::Delete_Points(const PointVector &PointToDel)
             operation.op = DELETE_POINT;
             pthread_mutex_lock(&working_flag_mutex);
             Delete_by_point(&Root_Node, PointToDel[i], false);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -809,38 +2026,20 @@ void KD_TREE<PointType>::Delete_Points(const PointVector &PointToDel)
 template <typename PointType>
 void KD_TREE<PointType>::Delete_Points_Accurate(const PointVector &PointToDel)
 {
-    for (size_t i = 0; i < PointToDel.size(); i++)
-    {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
-        {
-            Delete_by_point_accurate(&Root_Node, PointToDel[i], true);
-        }
-        else
-        {
-            Operation_Logger_Type operation;
-            operation.point = PointToDel[i];
-            operation.op = DELETE_POINT;
-            pthread_mutex_lock(&working_flag_mutex);
-            Delete_by_point_accurate(&Root_Node, PointToDel[i], false);
-            if (rebuild_flag)
-            {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }
-            pthread_mutex_unlock(&working_flag_mutex);
-        }
-    }
+    // Delete_Points is exact since BuildTree keeps equal keys on the right side, kept for compatibility
+    Delete_Points(PointToDel);
     return;
 }
 
 template <typename PointType>
 int KD_TREE<PointType>::Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints)
 {
+    Unfreeze();
     int tmp_counter = 0;
     for (size_t i = 0; i < BoxPoints.size(); i++)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        int slot_id = Rebuild_Slot_Of(Root_Node);
+        if (slot_id < 0)
         {
             tmp_counter += Delete_by_range(&Root_Node, BoxPoints[i], true, false);
         }
@@ -851,11 +2050,9 @@ int KD_TREE<PointType>::Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints
             operation.op = DELETE_BOX;
             pthread_mutex_lock(&working_flag_mutex);
             tmp_counter += Delete_by_range(&Root_Node, BoxPoints[i], false, false);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -866,6 +2063,7 @@ int KD_TREE<PointType>::Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints
 template <typename PointType>
 void KD_TREE<PointType>::Delete_Points_Downsample(const PointVector &PointToDel)
 {
+    Unfreeze();
     for (size_t i = 0; i < PointToDel.size(); i++)
     {
         BoxPointType Box_of_Point;
@@ -879,7 +2077,8 @@ void KD_TREE<PointType>::Delete_Points_Downsample(const PointVector &PointToDel)
         Box_of_Point.vertex_min[2] = z_key * downsample_size;
         Box_of_Point.vertex_max[2] = Box_of_Point.vertex_min[2] + downsample_size;
 
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        int slot_id = Rebuild_Slot_Of(Root_Node);
+        if (slot_id < 0)
         {
             Delete_by_range(&Root_Node, Box_of_Point, true, false);
         }
@@ -890,11 +2089,9 @@ void KD_TREE<PointType>::Delete_Points_Downsample(const PointVector &PointToDel)
             operation.op = DELETE_BOX;
             pthread_mutex_lock(&working_flag_mutex);
             Delete_by_range(&Root_Node, Box_of_Point, false, false);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
@@ -921,27 +2118,105 @@ void KD_TREE<PointType>::acquire_removed_points(PointVector &removed_points)
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, const int &l, const int &r, PointVector &Storage)
+void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, const int &l, const int &r, PointVector &Storage, KD_TREE_NODE *block, const ARRANGED_SPLIT *arranged)
 {
+    // block: contiguous storage for the Build_Node_Num nodes of this subtree, laid out in pre-order
+    // arranged: Storage is already split by Arrange_Storage, the splits of this subtree in pre-order
     if (l > r)
         return;
-    *root = new KD_TREE_NODE;
+    bool bucket_leaf = leaf_bucket_size > 0 && r - l <= leaf_bucket_size;
+    if (block == nullptr && arranged == nullptr && leaf_bucket_size > 0 && !bucket_leaf)
+    {
+        // The nodes of a tree with leaf buckets depend on the splits, which are found first
+        vector<ARRANGED_SPLIT> splits(r - l + 1);
+        Arrange_Storage(l, r, Storage, splits.data(), 0);
+        BuildTree(root, l, r, Storage, nullptr, splits.data());
+        return;
+    }
+    if (block == nullptr)
+        block = Node_Pool.allocate_block(Build_Node_Num(l, r, arranged));
+    *root = (block != nullptr) ? block : Node_Pool.allocate();
     InitTreeNode(*root);
+    if (bucket_leaf)
+    {
+        // One leaf, the other points go to its bucket
+        (*root)->point = Storage[l];
+        for (int i = l + 1; i <= r; i++)
+            Bucket_Append(*root, Storage[i]);
+        Update((*root));
+        return;
+    }
+    int split, div_axis;
+    // Divide by the division axis and recursively build.
+    if (arranged != nullptr)
+    {
+        split = arranged->split;
+        div_axis = arranged->division_axis;
+    }
+    else
+        split = Split_Storage(l, r, Storage, false, div_axis);
+    (*root)->division_axis = div_axis;
+    (*root)->point = Storage[split];
+    KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
+    int left_node_num = (block != nullptr) ? Build_Node_Num(l, split - 1, (arranged != nullptr) ? arranged + 1 : nullptr) : 0;
+    BuildTree(&left_son, l, split - 1, Storage, (block != nullptr) ? block + 1 : nullptr, (arranged != nullptr) ? arranged + 1 : nullptr);
+    BuildTree(&right_son, split + 1, r, Storage, (block != nullptr) ? block + 1 + left_node_num : nullptr, (arranged != nullptr) ? arranged + 1 + (split - l) : nullptr);
+    (*root)->left_son_ptr = left_son;
+    (*root)->right_son_ptr = right_son;
+    Update((*root));
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Split_Storage(const int &l, const int &r, PointVector &Storage, const bool &parallel_scan, int &div_axis)
+{
+    // Splits Storage[l, r] near the median of its longest dimension and returns the split index:
+    // points before it are strictly less and points after it are greater or equal on div_axis (see Strict_Split),
+    // so Add_by_point and Delete_by_point find an equal key on the right side only
     int mid = (l + r) >> 1;
-    int div_axis = 0;
     int i;
+    div_axis = 0;
     // Find the best division Axis
     float min_value[3] = {INFINITY, INFINITY, INFINITY};
     float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
     float dim_range[3] = {0, 0, 0};
-    for (i = l; i <= r; i++)
+    if (parallel_scan)
     {
-        min_value[0] = std::min(min_value[0], Storage[i].x);
-        min_value[1] = std::min(min_value[1], Storage[i].y);
-        min_value[2] = std::min(min_value[2], Storage[i].z);
-        max_value[0] = std::max(max_value[0], Storage[i].x);
-        max_value[1] = std::max(max_value[1], Storage[i].y);
-        max_value[2] = std::max(max_value[2], Storage[i].z);
+        // min and max are exact, so the chunked scan gives the serial result
+        int task_num = std::max(1, std::min(Worker_Pool.size(), (r - l + 1) / Parallel_Point_Num));
+        int chunk_size = (r - l + 1 + task_num - 1) / task_num;
+        vector<float> chunk_min(3 * task_num, INFINITY), chunk_max(3 * task_num, -INFINITY);
+        parallel_for(task_num, [&](int chunk)
+        {
+            int end = std::min(r + 1, l + (chunk + 1) * chunk_size);
+            float *c_min = &chunk_min[3 * chunk], *c_max = &chunk_max[3 * chunk];
+            for (int j = l + chunk * chunk_size; j < end; j++)
+            {
+                c_min[0] = std::min(c_min[0], Storage[j].x);
+                c_min[1] = std::min(c_min[1], Storage[j].y);
+                c_min[2] = std::min(c_min[2], Storage[j].z);
+                c_max[0] = std::max(c_max[0], Storage[j].x);
+                c_max[1] = std::max(c_max[1], Storage[j].y);
+                c_max[2] = std::max(c_max[2], Storage[j].z);
+            }
+        });
+        for (i = 0; i < 3 * task_num; i++)
+        {
+            min_value[i % 3] = std::min(min_value[i % 3], chunk_min[i]);
+            max_value[i % 3] = std::max(max_value[i % 3], chunk_max[i]);
+        }
+    }
+    else
+    {
+        for (i = l; i <= r; i++)
+        {
+            min_value[0] = std::min(min_value[0], Storage[i].x);
+            min_value[1] = std::min(min_value[1], Storage[i].y);
+            min_value[2] = std::min(min_value[2], Storage[i].z);
+            max_value[0] = std::max(max_value[0], Storage[i].x);
+            max_value[1] = std::max(max_value[1], Storage[i].y);
+            max_value[2] = std::max(max_value[2], Storage[i].z);
+        }
     }
     // Select the longest dimension as division axis
     for (i = 0; i < 3; i++)
@@ -949,9 +2224,45 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, const int &l, const int
     for (i = 1; i < 3; i++)
         if (dim_range[i] > dim_range[div_axis])
             div_axis = i;
-    // Divide by the division axis and recursively build.
+    // Keys repeated along a dimension (e.g. voxel centers) can leave the strict split unbalanced for Criterion_Check,
+    // which would then rebuild the subtree into the same shape again and again: the other dimensions are tried,
+    // and if none of them splits well (e.g. duplicated points) the plain median is kept. Equal keys may then lie
+    // on both sides, which Delete_by_point covers by looking on both sides of a key within EPSS
+    auto balanced = [&](const int &s) {
+        float balance_evaluation = float(s - l) / (r - l);
+        return r - l + 1 <= Minimal_Unbalanced_Tree_Size || (balance_evaluation <= balance_criterion_param && balance_evaluation >= 1 - balance_criterion_param);
+    };
+    int longest_axis = div_axis;
+    for (i = 0; i < 3; i++)
+    {
+        div_axis = (longest_axis + i) % 3;
+        if (i > 0 && dim_range[div_axis] <= 0)
+            continue;
+        int split = Strict_Split(l, r, Storage, div_axis);
+        if (balanced(split))
+            return split;
+    }
+    div_axis = longest_axis;
+    switch (div_axis)
+    {
+        case 0:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, point_cmp_x);
+            break;
+        case 1:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, point_cmp_y);
+            break;
+        default:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, point_cmp_z);
+            break;
+    }
+    return mid;
+}
 
-    (*root)->division_axis = div_axis;
+template <typename PointType>
+int KD_TREE<PointType>::Strict_Split(const int &l, const int &r, PointVector &Storage, const int &div_axis)
+{
+    // Returns a split index near (l + r) / 2 with Storage[l, split) < Storage[split] <= Storage(split, r] on div_axis
+    int mid = (l + r) >> 1;
     switch (div_axis)
     {
         case 0:
@@ -967,69 +2278,226 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, const int &l, const int
             std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, point_cmp_x);
             break;
     }
-    // int split_index = partition(begin(Storage) + mid + 1, begin(Storage) + r + 1, [&](PointType p)
-            // {return (Storage[mid].x==p.x && Storage[mid].y==p.y && Storage[mid].z==p.z);}) - begin(Storage) - 1;
-    // (*root)->point = Storage[split_index];
-    // KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
-    // if (l != split_index)
-    // {
-    //     int left_son_rightmost_index = 0;
-    //     if (split_index != 0)
-    //         left_son_rightmost_index = split_index - 1;
-    //     BuildTree(&left_son, l, left_son_rightmost_index, Storage);
-    //     (*root)->left_son_ptr = left_son;
-    // }
-    // if (r != split_index)
-    // {
-    //     BuildTree(&right_son, split_index + 1, r, Storage);
-    //     (*root)->right_son_ptr = right_son;
-    // }
-    (*root)->point = Storage[mid];
-    KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
-    BuildTree(&left_son, l, mid - 1, Storage);
-    BuildTree(&right_son, mid + 1, r, Storage);
-    (*root)->left_son_ptr = left_son;
-    (*root)->right_son_ptr = right_son;
-    Update((*root));
+    // nth_element leaves keys equal to the median on both sides of mid. The split is either the first of them
+    // (equal keys of the left part moved up to mid) or the first greater key (equal keys of the right part
+    // moved down to mid), whichever is nearer to mid
+    auto key = [&](const PointType &p) { return div_axis == 0 ? p.x : (div_axis == 1 ? p.y : p.z); };
+    float split_value = key(Storage[mid]);
+    int split_low = std::partition(begin(Storage) + l, begin(Storage) + mid, [&](const PointType &p) { return key(p) < split_value; }) - begin(Storage);
+    int split_high = std::partition(begin(Storage) + mid + 1, begin(Storage) + r + 1, [&](const PointType &p) { return !(split_value < key(p)); }) - begin(Storage);
+    if (split_high <= r && split_high - mid < mid - split_low)
+    {
+        // Storage[split_high] is the smallest greater key
+        std::iter_swap(begin(Storage) + split_high, std::min_element(begin(Storage) + split_high, begin(Storage) + r + 1, [&](const PointType &a, const PointType &b) { return key(a) < key(b); }));
+        return split_high;
+    }
+    return split_low;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Arrange_Storage(const int &l, const int &r, PointVector &Storage, ARRANGED_SPLIT *arranged, const int &fork_depth, const bool &parallel_scan)
+{
+    // Performs every split of BuildTree on Storage[l, r] without creating nodes. Each range only touches
+    // its own elements, so the sons are split on forked threads while fork_depth > 0, with the same result.
+    // parallel_scan: only for the top range, before any fork uses the cores
+    // The ranges BuildTree makes leaf buckets of are not split
+    if (l > r || (leaf_bucket_size > 0 && r - l <= leaf_bucket_size))
+        return;
+    int div_axis;
+    int split = Split_Storage(l, r, Storage, parallel_scan && r - l + 1 >= Parallel_Point_Num, div_axis);
+    arranged->split = split;
+    arranged->division_axis = div_axis;
+    if (fork_depth > 0 && r - l + 1 >= Parallel_Point_Num)
+    {
+        std::thread left_thread([&]() { Arrange_Storage(l, split - 1, Storage, arranged + 1, fork_depth - 1); });
+        Arrange_Storage(split + 1, r, Storage, arranged + 1 + (split - l), fork_depth - 1);
+        left_thread.join();
+    }
+    else
+    {
+        Arrange_Storage(l, split - 1, Storage, arranged + 1, 0);
+        Arrange_Storage(split + 1, r, Storage, arranged + 1 + (split - l), 0);
+    }
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Build_Node_Num(const int &l, const int &r, const ARRANGED_SPLIT *arranged)
+{
+    // Nodes BuildTree makes of Storage[l, r], one per point without leaf buckets
+    if (l > r)
+        return 0;
+    if (leaf_bucket_size == 0)
+        return r - l + 1;
+    if (r - l <= leaf_bucket_size)
+        return 1;
+    int split = arranged->split;
+    return 1 + Build_Node_Num(l, split - 1, arranged + 1) + Build_Node_Num(split + 1, r, arranged + 1 + (split - l));
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Bucket_Append(KD_TREE_NODE *leaf, const PointType &point)
+{
+    // The caller has checked there is room. A slot is filled before point_num counts it and a new
+    // bucket before the leaf links it, so readers never see a slot half written
+    LEAF_BUCKET *bucket = leaf->bucket;
+    if (bucket == nullptr)
+    {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, 64, sizeof(LEAF_BUCKET)) != 0)
+            throw std::bad_alloc();
+        bucket = new (memory) LEAF_BUCKET;
+        bucket->point_num.store(0, std::memory_order_relaxed);
+    }
+    int i = bucket->point_num.load(std::memory_order_relaxed);
+    bucket->points[i] = point;
+    bucket->coord[0][i] = point.x;
+    bucket->coord[1][i] = point.y;
+    bucket->coord[2][i] = point.z;
+    bucket->point_deleted[i] = false;
+    bucket->point_downsample_deleted[i] = false;
+    bucket->point_num.store(i + 1, std::memory_order_release);
+    if (leaf->bucket == nullptr)
+    {
+        // A leaf without sons or bucket has nothing to push down
+        leaf->need_push_down_to_left = false;
+        std::atomic_thread_fence(std::memory_order_release);
+        leaf->bucket = bucket;
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Bucket_Split(KD_TREE_NODE **root, const PointType &point)
+{
+    // A full leaf and the new point are built into a subtree aside and linked in one store, as Rebuild does.
+    // On a rebuild thread (replaying into its new subtree) the dropped deleted points are kept as it keeps them
+    KD_TREE_NODE *old_root_node = *root, *new_root_node = nullptr;
+    PointVector Storage;
+    if (!on_rebuild_thread())
+        flatten(old_root_node, Storage, DELETE_POINTS_REC);
+    else
+    {
+        pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+        flatten(old_root_node, Storage, MULTI_THREAD_REC);
+        pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+    }
+    Storage.push_back(point);
+    BuildTree(&new_root_node, 0, Storage.size() - 1, Storage);
+    new_root_node->father_ptr = old_root_node->father_ptr;
+    Publish_Node(root, new_root_node);
+    if (*root == Root_Node)
+        STATIC_ROOT_NODE->left_son_ptr = *root;
+    delete_tree_nodes(&old_root_node);
+    Voxel_Occupancy_Insert(point);
     return;
 }
 
+template <typename PointType>
+int KD_TREE<PointType>::Build_Fork_Depth()
+{
+    // Enough levels of forks to give every hardware thread a subtree
+    int fork_depth = 0;
+    while ((1 << fork_depth) < Worker_Pool.size())
+        fork_depth++;
+    return fork_depth;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Rebuild(KD_TREE_NODE **root)
 {
     KD_TREE_NODE *father_ptr;
     if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num)
     {
-        if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
+        // Posted subtrees stay disjoint: root is skipped inside a posted subtree or around a running one,
+        // and replaces the posted subtrees not started yet inside it
+        pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+        bool disjoint = true;
+        for (int i = 0; i < Rebuild_Slot_Num; i++)
         {
-            if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize))
-            {
-                Rebuild_Ptr = root;
-            }
-            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+            REBUILD_SLOT &slot = Rebuild_Slots[i];
+            if (slot.Rebuild_Ptr == nullptr)
+                continue;
+            if (Rebuild_Contains(*slot.Rebuild_Ptr, *root) || (slot.running && Rebuild_Contains(*root, *slot.Rebuild_Ptr)))
+                disjoint = false;
         }
+        int post_slot = -1;
+        for (int i = 0; i < Rebuild_Slot_Num && disjoint; i++)
+        {
+            REBUILD_SLOT &slot = Rebuild_Slots[i];
+            if (slot.Rebuild_Ptr != nullptr && !slot.running && Rebuild_Contains(*root, *slot.Rebuild_Ptr))
+                slot.Rebuild_Ptr = nullptr;
+            if (slot.Rebuild_Ptr == nullptr && post_slot < 0)
+                post_slot = i;
+        }
+        // All slots busy, the smallest subtree not started yet gives its slot to a larger one
+        for (int i = 0; i < Rebuild_Slot_Num && disjoint && post_slot < 0; i++)
+        {
+            REBUILD_SLOT &slot = Rebuild_Slots[i];
+            if (slot.running || (*slot.Rebuild_Ptr)->TreeSize >= (*root)->TreeSize)
+                continue;
+            if (post_slot < 0 || (*slot.Rebuild_Ptr)->TreeSize < (*Rebuild_Slots[post_slot].Rebuild_Ptr)->TreeSize)
+                post_slot = i;
+        }
+        if (post_slot >= 0)
+        {
+            Rebuild_Slots[post_slot].Rebuild_Ptr = root;
+            pthread_cond_broadcast(&rebuild_ptr_cond);
+        }
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
     }
     else
     {
         father_ptr = (*root)->father_ptr;
         PCL_Storage.clear();
         flatten(*root, PCL_Storage, DELETE_POINTS_REC);
-        delete_tree_nodes(root);
-        BuildTree(root, 0, PCL_Storage.size() - 1, PCL_Storage);
-        if (*root != nullptr)
-            (*root)->father_ptr = father_ptr;
+        // Built aside and linked in one store, readers see either the old or the new subtree
+        KD_TREE_NODE *old_root_node = *root, *new_root_node = nullptr;
+        BuildTree(&new_root_node, 0, PCL_Storage.size() - 1, PCL_Storage);
+        if (new_root_node != nullptr)
+            new_root_node->father_ptr = father_ptr;
+        Publish_Node(root, new_root_node);
         if (*root == Root_Node)
             STATIC_ROOT_NODE->left_son_ptr = *root;
+        delete_tree_nodes(&old_root_node);
     }
     return;
 }
 
+template <typename PointType>
+bool KD_TREE<PointType>::Rebuild_Contains(KD_TREE_NODE *root, KD_TREE_NODE *node)
+{
+    // Walks up from node, true if root is node or one of its fathers
+    while (node != nullptr && node != STATIC_ROOT_NODE)
+    {
+        if (node == root)
+            return true;
+        node = node->father_ptr;
+    }
+    return false;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Rebuild_Drop(const int &slot_id)
+{
+    // A subtree that became too small is rebuilt by the writer instead, unless its thread already took it
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    if (!Rebuild_Slots[slot_id].running)
+        Rebuild_Slots[slot_id].Rebuild_Ptr = nullptr;
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Reconstruct(PointVector &PointToRecon)
 {
     delete_tree_nodes(&Root_Node);
     PointVector().swap(PCL_Storage);
-    Rebuild_Logger.clear();
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        if (!Rebuild_Slots[i].running)
+            Rebuild_Slots[i].Rebuild_Logger.clear();
+    }
     Build(PointToRecon);
     return;
 }
@@ -1050,34 +2518,51 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, const BoxPointType
         return 0;
     if (boxpoint.vertex_min[0] <= (*root)->node_range_x[0] && boxpoint.vertex_max[0] > (*root)->node_range_x[1] && boxpoint.vertex_min[1] <= (*root)->node_range_y[0] && boxpoint.vertex_max[1] > (*root)->node_range_y[1] && boxpoint.vertex_min[2] <= (*root)->node_range_z[0] && boxpoint.vertex_max[2] > (*root)->node_range_z[1])
     {
+        Voxel_Occupancy_Update_Subtree(*root, false);
         (*root)->tree_deleted = true;
         (*root)->point_deleted = true;
         (*root)->need_push_down_to_left = true;
         (*root)->need_push_down_to_right = true;
         tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
         (*root)->invalid_point_num = (*root)->TreeSize;
+        (*root)->covered_invalid_num = (*root)->covered_num;
         if (is_downsample)
         {
             (*root)->tree_downsample_deleted = true;
             (*root)->point_downsample_deleted = true;
             (*root)->down_del_num = (*root)->TreeSize;
+            (*root)->covered_down_del_num = (*root)->covered_num;
         }
         return tmp_counter;
     }
     if (!(*root)->point_deleted && boxpoint.vertex_min[0] <= (*root)->point.x && boxpoint.vertex_max[0] > (*root)->point.x && boxpoint.vertex_min[1] <= (*root)->point.y && boxpoint.vertex_max[1] > (*root)->point.y && boxpoint.vertex_min[2] <= (*root)->point.z && boxpoint.vertex_max[2] > (*root)->point.z)
     {
+        Voxel_Occupancy_Erase((*root)->point);
         (*root)->point_deleted = true;
         tmp_counter += 1;
         if (is_downsample)
             (*root)->point_downsample_deleted = true;
     }
+    LEAF_BUCKET *bucket = (*root)->bucket;
+    for (int i = 0; bucket != nullptr && i < bucket->point_num.load(std::memory_order_relaxed); i++)
+    {
+        if (!bucket->point_deleted[i] && boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i])
+        {
+            Voxel_Occupancy_Erase(bucket->points[i]);
+            bucket->point_deleted[i] = true;
+            tmp_counter += 1;
+            if (is_downsample)
+                bucket->point_downsample_deleted[i] = true;
+        }
+    }
     Operation_Logger_Type delete_box_log;
     if (is_downsample)
         delete_box_log.op = DOWNSAMPLE_DELETE;
     else
         delete_box_log.op = DELETE_BOX;
     delete_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    int slot_id = Rebuild_Slot_Of((*root)->left_son_ptr);
+    if (slot_id < 0)
     {
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample);
     }
@@ -1085,15 +2570,14 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, const BoxPointType
     {
         pthread_mutex_lock(&working_flag_mutex);
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag)
+        if (Rebuild_Slots[slot_id].rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            Rebuild_Slots[slot_id].Rebuild_Logger.push(delete_box_log);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    slot_id = Rebuild_Slot_Of((*root)->right_son_ptr);
+    if (slot_id < 0)
     {
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
     }
@@ -1101,17 +2585,15 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, const BoxPointType
     {
         pthread_mutex_lock(&working_flag_mutex);
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag)
+        if (Rebuild_Slots[slot_id].rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            Rebuild_Slots[slot_id].Rebuild_Logger.push(delete_box_log);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && Rebuild_Slot_Of(*root) >= 0)
+        Rebuild_Drop(Rebuild_Slot_Of(*root));
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -1125,22 +2607,53 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, const PointType &p
 {
     if ((*root) == nullptr || (*root)->tree_deleted)
         return;
+    if ((point.x < (*root)->node_range_x[0] - EPSS) || (point.x > (*root)->node_range_x[1] + EPSS))
+        return;
+    if ((point.y < (*root)->node_range_y[0] - EPSS) || (point.y > (*root)->node_range_y[1] + EPSS))
+        return;
+    if ((point.z < (*root)->node_range_z[0] - EPSS) || (point.z > (*root)->node_range_z[1] + EPSS))
+        return;
     (*root)->working_flag = true;
     Push_Down(*root);
     if (same_point((*root)->point, point) && !(*root)->point_deleted)
     {
+        Voxel_Occupancy_Erase((*root)->point);
         (*root)->point_deleted = true;
         (*root)->invalid_point_num += 1;
+        if (Traits::covered((*root)->point))
+            (*root)->covered_invalid_num += 1;
         if ((*root)->invalid_point_num == (*root)->TreeSize)
             (*root)->tree_deleted = true;
         return;
     }
+    LEAF_BUCKET *bucket = (*root)->bucket;
+    if (bucket != nullptr)
+    {
+        int point_num = bucket->point_num.load(std::memory_order_relaxed);
+        for (int i = 0; i < point_num; i++)
+        {
+            if (!bucket->point_deleted[i] && same_point(bucket->points[i], point))
+            {
+                Voxel_Occupancy_Erase(bucket->points[i]);
+                bucket->point_deleted[i] = true;
+                Update(*root);
+                break;
+            }
+        }
+        (*root)->working_flag = false;
+        return;
+    }
     Operation_Logger_Type delete_log;
     delete_log.op = DELETE_POINT;
     delete_log.point = point;
-    if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z))
+    // Left sons are < and right sons are >= the division value, only a point within EPSS of it
+    // (same_point tolerance) has to be looked for on both sides
+    float point_value = (*root)->division_axis == 0 ? point.x : ((*root)->division_axis == 1 ? point.y : point.z);
+    float division_value = (*root)->division_axis == 0 ? (*root)->point.x : ((*root)->division_axis == 1 ? (*root)->point.y : (*root)->point.z);
+    if (point_value < division_value + EPSS)
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        int slot_id = Rebuild_Slot_Of((*root)->left_son_ptr);
+        if (slot_id < 0)
         {
             Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);
         }
@@ -1148,18 +2661,17 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, const PointType &p
         {
             pthread_mutex_lock(&working_flag_mutex);
             Delete_by_point(&(*root)->left_son_ptr, point, false);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(delete_log);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
-    else
+    if (point_value > division_value - EPSS)
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        int slot_id = Rebuild_Slot_Of((*root)->right_son_ptr);
+        if (slot_id < 0)
         {
             Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);
         }
@@ -1167,79 +2679,16 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, const PointType &p
         {
             pthread_mutex_lock(&working_flag_mutex);
             Delete_by_point(&(*root)->right_son_ptr, point, false);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(delete_log);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
-    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
-    if (need_rebuild)
-        Rebuild(root);
-    if ((*root) != nullptr)
-        (*root)->working_flag = false;
-    return;
-}
-
-template <typename PointType>
-void KD_TREE<PointType>::Delete_by_point_accurate(KD_TREE_NODE **root, const PointType &point, const bool &allow_rebuild)
-{
-    if ((*root) == nullptr || (*root)->tree_deleted)
-        return;
-    (*root)->working_flag = true;
-    Push_Down(*root);
-    if (same_point((*root)->point, point) && !(*root)->point_deleted)
-    {
-        (*root)->point_deleted = true;
-        (*root)->invalid_point_num += 1;
-        if ((*root)->invalid_point_num == (*root)->TreeSize)
-            (*root)->tree_deleted = true;
-        return;
-    }
-    Operation_Logger_Type delete_log;
-    delete_log.op = DELETE_POINT;
-    delete_log.point = point;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
-    {
-        Delete_by_point_accurate(&(*root)->left_son_ptr, point, allow_rebuild);
-    }
-    else
-    {
-        pthread_mutex_lock(&working_flag_mutex);
-        Delete_by_point_accurate(&(*root)->left_son_ptr, point, false);
-        if (rebuild_flag)
-        {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-        }
-        pthread_mutex_unlock(&working_flag_mutex);
-    }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
-    {
-        Delete_by_point_accurate(&(*root)->right_son_ptr, point, allow_rebuild);
-    }
-    else
-    {
-        pthread_mutex_lock(&working_flag_mutex);
-        Delete_by_point_accurate(&(*root)->right_son_ptr, point, false);
-        if (rebuild_flag)
-        {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-        }
-        pthread_mutex_unlock(&working_flag_mutex);
-    }
-    Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && Rebuild_Slot_Of(*root) >= 0)
+        Rebuild_Drop(Rebuild_Slot_Of(*root));
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -1263,21 +2712,36 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, const BoxPointType &b
         return;
     if (boxpoint.vertex_min[0] <= (*root)->node_range_x[0] && boxpoint.vertex_max[0] > (*root)->node_range_x[1] && boxpoint.vertex_min[1] <= (*root)->node_range_y[0] && boxpoint.vertex_max[1] > (*root)->node_range_y[1] && boxpoint.vertex_min[2] <= (*root)->node_range_z[0] && boxpoint.vertex_max[2] > (*root)->node_range_z[1])
     {
+        Voxel_Occupancy_Update_Subtree(*root, true);
         (*root)->tree_deleted = false || (*root)->tree_downsample_deleted;
         (*root)->point_deleted = false || (*root)->point_downsample_deleted;
         (*root)->need_push_down_to_left = true;
         (*root)->need_push_down_to_right = true;
         (*root)->invalid_point_num = (*root)->down_del_num;
+        (*root)->covered_invalid_num = (*root)->covered_down_del_num;
         return;
     }
     if (boxpoint.vertex_min[0] <= (*root)->point.x && boxpoint.vertex_max[0] > (*root)->point.x && boxpoint.vertex_min[1] <= (*root)->point.y && boxpoint.vertex_max[1] > (*root)->point.y && boxpoint.vertex_min[2] <= (*root)->point.z && boxpoint.vertex_max[2] > (*root)->point.z)
     {
+        if ((*root)->point_deleted && !(*root)->point_downsample_deleted)
+            Voxel_Occupancy_Insert((*root)->point);
         (*root)->point_deleted = (*root)->point_downsample_deleted;
     }
+    LEAF_BUCKET *bucket = (*root)->bucket;
+    for (int i = 0; bucket != nullptr && i < bucket->point_num.load(std::memory_order_relaxed); i++)
+    {
+        if (boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i])
+        {
+            if (bucket->point_deleted[i] && !bucket->point_downsample_deleted[i])
+                Voxel_Occupancy_Insert(bucket->points[i]);
+            bucket->point_deleted[i] = bucket->point_downsample_deleted[i];
+        }
+    }
     Operation_Logger_Type add_box_log;
     add_box_log.op = ADD_BOX;
     add_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    int slot_id = Rebuild_Slot_Of((*root)->left_son_ptr);
+    if (slot_id < 0)
     {
         Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild);
     }
@@ -1285,15 +2749,14 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, const BoxPointType &b
     {
         pthread_mutex_lock(&working_flag_mutex);
         Add_by_range(&((*root)->left_son_ptr), boxpoint, false);
-        if (rebuild_flag)
+        if (Rebuild_Slots[slot_id].rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            Rebuild_Slots[slot_id].Rebuild_Logger.push(add_box_log);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    slot_id = Rebuild_Slot_Of((*root)->right_son_ptr);
+    if (slot_id < 0)
     {
         Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild);
     }
@@ -1301,17 +2764,15 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, const BoxPointType &b
     {
         pthread_mutex_lock(&working_flag_mutex);
         Add_by_range(&((*root)->right_son_ptr), boxpoint, false);
-        if (rebuild_flag)
+        if (Rebuild_Slots[slot_id].rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            Rebuild_Slots[slot_id].Rebuild_Logger.push(add_box_log);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && Rebuild_Slot_Of(*root) >= 0)
+        Rebuild_Drop(Rebuild_Slot_Of(*root));
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -1325,11 +2786,13 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, const PointType &poin
 {
     if (*root == nullptr)
     {
-        *root = new KD_TREE_NODE;
-        InitTreeNode(*root);
-        (*root)->point = point;
-        (*root)->division_axis = (father_axis + 1) % 3;
-        Update(*root);
+        KD_TREE_NODE *new_node = Node_Pool.allocate();
+        InitTreeNode(new_node);
+        new_node->point = point;
+        new_node->division_axis = (father_axis + 1) % 3;
+        Update(new_node);
+        Publish_Node(root, new_node);
+        Voxel_Occupancy_Insert(point);
         return;
     }
     (*root)->working_flag = true;
@@ -1337,9 +2800,24 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, const PointType &poin
     add_log.op = ADD_POINT;
     add_log.point = point;
     Push_Down(*root);
+    // While leaf buckets are on a leaf takes the point into its bucket, a full bucket is split
+    if ((*root)->bucket != nullptr || (leaf_bucket_size > 0 && (*root)->left_son_ptr == nullptr && (*root)->right_son_ptr == nullptr))
+    {
+        if ((*root)->bucket != nullptr && (*root)->bucket->point_num.load(std::memory_order_relaxed) >= leaf_bucket_size)
+        {
+            Bucket_Split(root, point);
+            return;
+        }
+        Bucket_Append(*root, point);
+        Update(*root);
+        Voxel_Occupancy_Insert(point);
+        (*root)->working_flag = false;
+        return;
+    }
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z))
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        int slot_id = Rebuild_Slot_Of((*root)->left_son_ptr);
+        if (slot_id < 0)
         {
             Add_by_point(&(*root)->left_son_ptr, point, allow_rebuild, (*root)->division_axis);
         }
@@ -1347,18 +2825,17 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, const PointType &poin
         {
             pthread_mutex_lock(&working_flag_mutex);
             Add_by_point(&(*root)->left_son_ptr, point, false, (*root)->division_axis);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(add_log);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
     else
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        int slot_id = Rebuild_Slot_Of((*root)->right_son_ptr);
+        if (slot_id < 0)
         {
             Add_by_point(&(*root)->right_son_ptr, point, allow_rebuild, (*root)->division_axis);
         }
@@ -1366,18 +2843,16 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, const PointType &poin
         {
             pthread_mutex_lock(&working_flag_mutex);
             Add_by_point(&(*root)->right_son_ptr, point, false, (*root)->division_axis);
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(add_log);
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && Rebuild_Slot_Of(*root) >= 0)
+        Rebuild_Drop(Rebuild_Slot_Of(*root));
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -1387,39 +2862,47 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, const PointType &poin
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search(KD_TREE_NODE *root, const int &k_nearest, const PointType &point, MANUAL_HEAP &q, const float &max_dist)
+template <typename HeapType>
+void KD_TREE<PointType>::Search(KD_TREE_NODE *root, const int &k_nearest, const PointType &point, HeapType &q, const float &max_dist, const LAZY_LABELS &father_labels)
 {
-    if (root == nullptr || root->tree_deleted)
+    if (root == nullptr)
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
         return;
     float cur_dist = calc_box_dist(root, point);
     float max_dist_sqr = max_dist * max_dist;
     if (cur_dist > max_dist_sqr)
         return;
-    int retval;
-    if (root->need_push_down_to_left || root->need_push_down_to_right)
+    if (!labels.point_deleted)
     {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0)
-        {
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-        else
+        float dist = calc_dist(point, root->point);
+        if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
         {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
+            if (q.size() >= k_nearest)
+                q.pop();
+            PointType_CMP current_point{root->point, dist};
+            q.push(current_point);
         }
     }
-    if (!root->point_deleted)
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
     {
-        float dist = calc_dist(point, root->point);
-        if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
+        // A bucket leaf has no sons
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        float bucket_dist[Leaf_Bucket_Max];
+        Bucket_Dist(bucket->coord[0], bucket->coord[1], bucket->coord[2], point_num, point, bucket_dist);
+        for (int i = 0; i < point_num; i++)
         {
+            if (bucket_dist[i] > max_dist_sqr || (q.size() >= k_nearest && bucket_dist[i] >= q.top().dist) || Slot_Deleted(bucket, i, slot_labels))
+                continue;
             if (q.size() >= k_nearest)
                 q.pop();
-            PointType_CMP current_point{root->point, dist};
+            PointType_CMP current_point{bucket->points[i], bucket_dist[i]};
             q.push(current_point);
         }
+        return;
     }
 
     float dist_left_node = calc_box_dist(root->left_son_ptr, point);
@@ -1428,94 +2911,18 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE *root, const int &k_nearest, const
     {
         if (dist_left_node <= dist_right_node)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-            {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(root->left_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_left));
             if (q.size() < k_nearest || dist_right_node < q.top().dist)
             {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-                {
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
+                Search(root->right_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_right));
             }
         }
         else
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-            {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            Search(root->right_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_right));
             if (q.size() < k_nearest || dist_left_node < q.top().dist)
             {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-                {
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
+                Search(root->left_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_left));
             }
         }
     }
@@ -1523,194 +2930,707 @@ void KD_TREE<PointType>::Search(KD_TREE_NODE *root, const int &k_nearest, const
     {
         if (dist_left_node < q.top().dist)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-            {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
+            Search(root->left_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_left));
+        }
+        if (dist_right_node < q.top().dist)
+        {
+            Search(root->right_son_ptr, k_nearest, point, q, max_dist, Son_Labels(labels, root->need_push_down_to_right));
+        }
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, PointVector &Storage, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return;
+    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+    {
+        flatten(root, Storage, NOT_RECORD, father_labels);
+        return;
+    }
+    if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+    {
+        if (!labels.point_deleted)
+            Storage.push_back(root->point);
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+            if (boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i] && !Slot_Deleted(bucket, i, slot_labels))
+                Storage.push_back(bucket->points[i]);
+    }
+    Search_by_range(root->left_son_ptr, boxpoint, Storage, Son_Labels(labels, root->need_push_down_to_left));
+    Search_by_range(root->right_son_ptr, boxpoint, Storage, Son_Labels(labels, root->need_push_down_to_right));
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, PointVector &Storage, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    // Squared distances to the nearest and the farthest point of the node box
+    if (calc_box_dist(root, point) > radius_sq)
+        return;
+    if (calc_box_max_dist(root, point) <= radius_sq)
+    {
+        flatten(root, Storage, NOT_RECORD, father_labels);
+        return;
+    }
+    if (!labels.point_deleted && calc_dist(root->point, point) <= radius_sq){
+        Storage.push_back(root->point);
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        float bucket_dist[Leaf_Bucket_Max];
+        Bucket_Dist(bucket->coord[0], bucket->coord[1], bucket->coord[2], point_num, point, bucket_dist);
+        for (int i = 0; i < point_num; i++)
+            if (bucket_dist[i] <= radius_sq && !Slot_Deleted(bucket, i, slot_labels))
+                Storage.push_back(bucket->points[i]);
+    }
+    Search_by_radius(root->left_son_ptr, point, radius_sq, Storage, Son_Labels(labels, root->need_push_down_to_left));
+    Search_by_radius(root->right_son_ptr, point, radius_sq, Storage, Son_Labels(labels, root->need_push_down_to_right));
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Count_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return 0;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return 0;
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return 0;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return 0;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return 0;
+    int valid_num, covered_num;
+    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+    {
+        Lazy_Counts(root, father_labels, valid_num, covered_num);
+        return valid_num;
+    }
+    int count = 0;
+    if (!labels.point_deleted && boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+        count++;
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+            if (boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i] && !Slot_Deleted(bucket, i, slot_labels))
+                count++;
+    }
+    count += Count_by_range(root->left_son_ptr, boxpoint, Son_Labels(labels, root->need_push_down_to_left));
+    count += Count_by_range(root->right_son_ptr, boxpoint, Son_Labels(labels, root->need_push_down_to_right));
+    return count;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Count_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return 0;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted || calc_box_dist(root, point) > radius_sq)
+        return 0;
+    int valid_num, covered_num;
+    if (calc_box_max_dist(root, point) <= radius_sq)
+    {
+        Lazy_Counts(root, father_labels, valid_num, covered_num);
+        return valid_num;
+    }
+    int count = (!labels.point_deleted && calc_dist(root->point, point) <= radius_sq) ? 1 : 0;
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        float bucket_dist[Leaf_Bucket_Max];
+        Bucket_Dist(bucket->coord[0], bucket->coord[1], bucket->coord[2], point_num, point, bucket_dist);
+        for (int i = 0; i < point_num; i++)
+            if (bucket_dist[i] <= radius_sq && !Slot_Deleted(bucket, i, slot_labels))
+                count++;
+    }
+    count += Count_by_radius(root->left_son_ptr, point, radius_sq, Son_Labels(labels, root->need_push_down_to_left));
+    count += Count_by_radius(root->right_son_ptr, point, radius_sq, Son_Labels(labels, root->need_push_down_to_right));
+    return count;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::CollisionCheckRecursive(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr) return false;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted || calc_box_dist(root, point) > radius_sq) return false;
+    // A box inside the sphere collides if any of its points is valid
+    if (calc_box_max_dist(root, point) <= radius_sq)
+    {
+        int valid_num, covered_num;
+        Lazy_Counts(root, father_labels, valid_num, covered_num);
+        return valid_num > 0;
+    }
+    if (!labels.point_deleted && calc_dist(root->point, point) <= radius_sq){
+        return true;
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        float bucket_dist[Leaf_Bucket_Max];
+        Bucket_Dist(bucket->coord[0], bucket->coord[1], bucket->coord[2], point_num, point, bucket_dist);
+        for (int i = 0; i < point_num; i++)
+            if (bucket_dist[i] <= radius_sq && !Slot_Deleted(bucket, i, slot_labels))
+                return true;
+    }
+    if (CollisionCheckRecursive(root->left_son_ptr, point, radius_sq, Son_Labels(labels, root->need_push_down_to_left)))
+    {
+        return true;
+    }
+    if (CollisionCheckRecursive(root->right_son_ptr, point, radius_sq, Son_Labels(labels, root->need_push_down_to_right)))
+    {
+        return true;
+    }
+    return false;
+}
+
+template <typename PointType>
+size_t KD_TREE<PointType>::Frozen_Block_Bytes(const int &node_num)
+{
+    // Every array starts on a cache line
+    size_t point_bytes = (sizeof(PointType) * node_num + 63) & ~size_t(63);
+    size_t range_bytes = (sizeof(float) * node_num + 63) & ~size_t(63);
+    return point_bytes + 10 * range_bytes;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Assign(FROZEN_TREE &frozen_tree, char *block, const int &node_num)
+{
+    size_t point_bytes = (sizeof(PointType) * node_num + 63) & ~size_t(63);
+    size_t range_bytes = (sizeof(float) * node_num + 63) & ~size_t(63);
+    frozen_tree.node_num = node_num;
+    frozen_tree.block = block;
+    frozen_tree.block_bytes = Frozen_Block_Bytes(node_num);
+    frozen_tree.points = (PointType *)block;
+    for (int i = 0; i < 3; i++)
+    {
+        frozen_tree.coord[i] = (float *)(block + point_bytes + i * range_bytes);
+        frozen_tree.range_min[i] = (float *)(block + point_bytes + (3 + 2 * i) * range_bytes);
+        frozen_tree.range_max[i] = (float *)(block + point_bytes + (4 + 2 * i) * range_bytes);
+    }
+    frozen_tree.covered_num = (int *)(block + point_bytes + 9 * range_bytes);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Publish(FROZEN_TREE *frozen_tree)
+{
+    // Switches the queries to frozen_tree (nullptr: the dynamic tree). The replaced layout is retired
+    // like the nodes, so queries that loaded it keep reading it until they leave their epoch
+    FROZEN_TREE *old_frozen_tree = Frozen_Tree.exchange(frozen_tree, std::memory_order_acq_rel);
+    if (old_frozen_tree == nullptr)
+        return;
+    pthread_mutex_lock(&retire_mutex_lock);
+    Retired_Frozen.push_back(RETIRED_FROZEN{old_frozen_tree, Epoch.current()});
+    pthread_mutex_unlock(&retire_mutex_lock);
+    Reclaim_Nodes(false);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Free(FROZEN_TREE *frozen_tree)
+{
+    if (frozen_tree->map_base != nullptr)
+        munmap(frozen_tree->map_base, frozen_tree->map_bytes);
+    else if (frozen_tree->block != nullptr)
+        free(frozen_tree->block);
+    delete frozen_tree;
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Build(FROZEN_TREE &frozen_tree, const int &p, const int &n, PointVector &Storage, const int &l)
+{
+    // Median of the longest dimension, Storage[l, l + n) goes to [p, p + n). Nothing is deleted from the
+    // frozen layout, so it keeps the implicit (n - 1) / 2 split instead of the strict one of Split_Storage
+    float min_value[3] = {INFINITY, INFINITY, INFINITY};
+    float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int covered_num = 0;
+    for (int i = l; i < l + n; i++)
+    {
+        covered_num += Traits::covered(Storage[i]) ? 1 : 0;
+        min_value[0] = std::min(min_value[0], Storage[i].x);
+        min_value[1] = std::min(min_value[1], Storage[i].y);
+        min_value[2] = std::min(min_value[2], Storage[i].z);
+        max_value[0] = std::max(max_value[0], Storage[i].x);
+        max_value[1] = std::max(max_value[1], Storage[i].y);
+        max_value[2] = std::max(max_value[2], Storage[i].z);
+    }
+    frozen_tree.covered_num[p] = covered_num;
+    int div_axis = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        frozen_tree.range_min[i][p] = min_value[i];
+        frozen_tree.range_max[i][p] = max_value[i];
+        if (max_value[i] - min_value[i] > max_value[div_axis] - min_value[div_axis])
+            div_axis = i;
+    }
+    if (n <= Frozen_Bucket_Size)
+    {
+        // Leaf bucket: points in any order, only the box of p is used
+        for (int i = 0; i < n; i++)
+        {
+            frozen_tree.points[p + i] = Storage[l + i];
+            frozen_tree.coord[0][p + i] = Storage[l + i].x;
+            frozen_tree.coord[1][p + i] = Storage[l + i].y;
+            frozen_tree.coord[2][p + i] = Storage[l + i].z;
+        }
+        return;
+    }
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    int mid = l + left_num;
+    switch (div_axis)
+    {
+        case 0:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + l + n, point_cmp_x);
+            break;
+        case 1:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + l + n, point_cmp_y);
+            break;
+        default:
+            std::nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + l + n, point_cmp_z);
+            break;
+    }
+    frozen_tree.points[p] = Storage[mid];
+    frozen_tree.coord[0][p] = Storage[mid].x;
+    frozen_tree.coord[1][p] = Storage[mid].y;
+    frozen_tree.coord[2][p] = Storage[mid].z;
+    if (left_num > 0)
+        Frozen_Build(frozen_tree, p + 1, left_num, Storage, l);
+    if (right_num > 0)
+        Frozen_Build(frozen_tree, p + 1 + left_num, right_num, Storage, mid + 1);
+    return;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Frozen_Box_Dist(const FROZEN_TREE &frozen_tree, const int &p, const PointType &point)
+{
+    const float coord[3] = {point.x, point.y, point.z};
+    float min_dist = 0.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        float d = std::max(std::max(frozen_tree.range_min[i][p] - coord[i], coord[i] - frozen_tree.range_max[i][p]), 0.0f);
+        min_dist += d * d;
+    }
+    return min_dist;
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::Frozen_Box_Max_Dist(const FROZEN_TREE &frozen_tree, const int &p, const PointType &point)
+{
+    // Squared distance to the farthest corner of the box of node p
+    const float coord[3] = {point.x, point.y, point.z};
+    float max_dist = 0.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        float d = std::max(coord[i] - frozen_tree.range_min[i][p], frozen_tree.range_max[i][p] - coord[i]);
+        max_dist += d * d;
+    }
+    return max_dist;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Bucket_Dist(const float *xs, const float *ys, const float *zs, const int &n, const PointType &point, float *dist)
+{
+    // Squared distances from point to the n points of xs, ys, zs, 8 (AVX) or 4 (SSE) at a time
+    int i = 0;
+#if defined(__AVX__)
+    __m256 px8 = _mm256_set1_ps(point.x), py8 = _mm256_set1_ps(point.y), pz8 = _mm256_set1_ps(point.z);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), px8);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), py8);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + i), pz8);
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        _mm256_storeu_ps(dist + i, d);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128 px4 = _mm_set1_ps(point.x), py4 = _mm_set1_ps(point.y), pz4 = _mm_set1_ps(point.z);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), px4);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), py4);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs + i), pz4);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        _mm_storeu_ps(dist + i, d);
+    }
+#endif
+    for (; i < n; i++)
+        dist[i] = (xs[i] - point.x) * (xs[i] - point.x) + (ys[i] - point.y) * (ys[i] - point.y) + (zs[i] - point.z) * (zs[i] - point.z);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Bucket_Dist(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, float *dist)
+{
+    // Squared distances from point to the n points from p
+    Bucket_Dist(frozen_tree.coord[0] + p, frozen_tree.coord[1] + p, frozen_tree.coord[2] + p, n, point, dist);
+    return;
+}
+
+template <typename PointType>
+template <typename HeapType>
+void KD_TREE<PointType>::Frozen_Search(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const int &k_nearest, const PointType &point, HeapType &q, const float &max_dist_sqr)
+{
+    // The caller has already checked the box of node p
+    if (n <= Frozen_Bucket_Size)
+    {
+        float bucket_dist[Frozen_Bucket_Size];
+        Frozen_Bucket_Dist(frozen_tree, p, n, point, bucket_dist);
+        for (int i = 0; i < n; i++)
+        {
+            if (bucket_dist[i] <= max_dist_sqr && (q.size() < k_nearest || bucket_dist[i] < q.top().dist))
             {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
+                if (q.size() >= k_nearest)
+                    q.pop();
+                PointType_CMP current_point{frozen_tree.points[p + i], bucket_dist[i]};
+                q.push(current_point);
             }
         }
-        if (dist_right_node < q.top().dist)
+        return;
+    }
+    float dist = calc_dist(point, frozen_tree.points[p]);
+    if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
+    {
+        if (q.size() >= k_nearest)
+            q.pop();
+        PointType_CMP current_point{frozen_tree.points[p], dist};
+        q.push(current_point);
+    }
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    int left = p + 1, right = p + 1 + left_num;
+    float dist_left_node = (left_num > 0) ? Frozen_Box_Dist(frozen_tree, left, point) : INFINITY;
+    float dist_right_node = (right_num > 0) ? Frozen_Box_Dist(frozen_tree, right, point) : INFINITY;
+    // Nearer son first, the farther one is checked again against the updated heap
+    if (dist_left_node <= dist_right_node)
+    {
+        if (left_num > 0 && dist_left_node <= max_dist_sqr && (q.size() < k_nearest || dist_left_node < q.top().dist))
+            Frozen_Search(frozen_tree, left, left_num, k_nearest, point, q, max_dist_sqr);
+        if (right_num > 0 && dist_right_node <= max_dist_sqr && (q.size() < k_nearest || dist_right_node < q.top().dist))
+            Frozen_Search(frozen_tree, right, right_num, k_nearest, point, q, max_dist_sqr);
+    }
+    else
+    {
+        if (right_num > 0 && dist_right_node <= max_dist_sqr && (q.size() < k_nearest || dist_right_node < q.top().dist))
+            Frozen_Search(frozen_tree, right, right_num, k_nearest, point, q, max_dist_sqr);
+        if (left_num > 0 && dist_left_node <= max_dist_sqr && (q.size() < k_nearest || dist_left_node < q.top().dist))
+            Frozen_Search(frozen_tree, left, left_num, k_nearest, point, q, max_dist_sqr);
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Search_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, PointVector &Storage)
+{
+    // Same half-open box as Search_by_range
+    bool contained = true;
+    for (int i = 0; i < 3; i++)
+    {
+        if (boxpoint.vertex_max[i] <= frozen_tree.range_min[i][p] || boxpoint.vertex_min[i] > frozen_tree.range_max[i][p])
+            return;
+        contained = contained && boxpoint.vertex_min[i] <= frozen_tree.range_min[i][p] && boxpoint.vertex_max[i] > frozen_tree.range_max[i][p];
+    }
+    if (contained)
+    {
+        Storage.insert(Storage.end(), frozen_tree.points + p, frozen_tree.points + p + n);
+        return;
+    }
+    if (n <= Frozen_Bucket_Size)
+    {
+        for (int i = p; i < p + n; i++)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-            {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            const PointType &bucket_point = frozen_tree.points[i];
+            if (boxpoint.vertex_min[0] <= bucket_point.x && boxpoint.vertex_max[0] > bucket_point.x && boxpoint.vertex_min[1] <= bucket_point.y && boxpoint.vertex_max[1] > bucket_point.y && boxpoint.vertex_min[2] <= bucket_point.z && boxpoint.vertex_max[2] > bucket_point.z)
+                Storage.push_back(bucket_point);
         }
+        return;
     }
+    const PointType &root_point = frozen_tree.points[p];
+    if (boxpoint.vertex_min[0] <= root_point.x && boxpoint.vertex_max[0] > root_point.x && boxpoint.vertex_min[1] <= root_point.y && boxpoint.vertex_max[1] > root_point.y && boxpoint.vertex_min[2] <= root_point.z && boxpoint.vertex_max[2] > root_point.z)
+        Storage.push_back(root_point);
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        Frozen_Search_by_range(frozen_tree, p + 1, left_num, boxpoint, Storage);
+    if (right_num > 0)
+        Frozen_Search_by_range(frozen_tree, p + 1 + left_num, right_num, boxpoint, Storage);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, PointVector &Storage)
+void KD_TREE<PointType>::Frozen_Get_Covered(const FROZEN_TREE &frozen_tree, const int &p, const int &n, PointVector &Storage, const bool &get_covered_or_uncovered)
 {
-    if (root == nullptr)
-        return;
-    Push_Down(root);
-    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
-        return;
-    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
-        return;
-    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+    // Subtrees with only one kind of points are skipped or copied whole
+    int wanted_num = get_covered_or_uncovered ? frozen_tree.covered_num[p] : n - frozen_tree.covered_num[p];
+    if (wanted_num == 0)
         return;
-    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+    if (wanted_num == n)
     {
-        flatten(root, Storage, NOT_RECORD);
+        Storage.insert(Storage.end(), frozen_tree.points + p, frozen_tree.points + p + n);
         return;
     }
-    if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
-    {
-        if (!root->point_deleted)
-            Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
+    if (n <= Frozen_Bucket_Size)
     {
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
+        for (int i = p; i < p + n; i++)
+            if (Traits::covered(frozen_tree.points[i]) == get_covered_or_uncovered)
+                Storage.push_back(frozen_tree.points[i]);
+        return;
     }
-    else
+    if (Traits::covered(frozen_tree.points[p]) == get_covered_or_uncovered)
+        Storage.push_back(frozen_tree.points[p]);
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        Frozen_Get_Covered(frozen_tree, p + 1, left_num, Storage, get_covered_or_uncovered);
+    if (right_num > 0)
+        Frozen_Get_Covered(frozen_tree, p + 1 + left_num, right_num, Storage, get_covered_or_uncovered);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Covered_Count(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, int &covered_num, int &uncovered_num)
+{
+    // Same half-open box as Search_by_range
+    bool contained = true;
+    for (int i = 0; i < 3; i++)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        if (boxpoint.vertex_max[i] <= frozen_tree.range_min[i][p] || boxpoint.vertex_min[i] > frozen_tree.range_max[i][p])
+            return;
+        contained = contained && boxpoint.vertex_min[i] <= frozen_tree.range_min[i][p] && boxpoint.vertex_max[i] > frozen_tree.range_max[i][p];
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    if (contained)
     {
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
+        covered_num += frozen_tree.covered_num[p];
+        uncovered_num += n - frozen_tree.covered_num[p];
+        return;
     }
-    else
+    int point_num = n <= Frozen_Bucket_Size ? n : 1;
+    for (int i = p; i < p + point_num; i++)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        const PointType &point = frozen_tree.points[i];
+        if (boxpoint.vertex_min[0] <= point.x && boxpoint.vertex_max[0] > point.x && boxpoint.vertex_min[1] <= point.y && boxpoint.vertex_max[1] > point.y && boxpoint.vertex_min[2] <= point.z && boxpoint.vertex_max[2] > point.z)
+        {
+            if (Traits::covered(point))
+                covered_num++;
+            else
+                uncovered_num++;
+        }
     }
+    if (n <= Frozen_Bucket_Size)
+        return;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        Frozen_Covered_Count(frozen_tree, p + 1, left_num, boxpoint, covered_num, uncovered_num);
+    if (right_num > 0)
+        Frozen_Covered_Count(frozen_tree, p + 1 + left_num, right_num, boxpoint, covered_num, uncovered_num);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius, PointVector &Storage)
+void KD_TREE<PointType>::Frozen_Search_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq, PointVector &Storage)
 {
-    if (root == nullptr)
+    if (Frozen_Box_Dist(frozen_tree, p, point) > radius_sq)
         return;
-    Push_Down(root);
-    PointType range_center;
-    range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
-    range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
-    range_center.z = (root->node_range_z[0] + root->node_range_z[1]) * 0.5;
-    float dist = std::sqrt(calc_dist(range_center, point));
-    if (dist > radius + std::sqrt(root->radius_sq)) return;
-    if (dist <= radius - std::sqrt(root->radius_sq)) 
+    if (Frozen_Box_Max_Dist(frozen_tree, p, point) <= radius_sq)
     {
-        flatten(root, Storage, NOT_RECORD);
+        Storage.insert(Storage.end(), frozen_tree.points + p, frozen_tree.points + p + n);
         return;
     }
-    if (!root->point_deleted && calc_dist(root->point, point) <= radius * radius){
-        Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
+    if (n <= Frozen_Bucket_Size)
     {
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
+        float bucket_dist[Frozen_Bucket_Size];
+        Frozen_Bucket_Dist(frozen_tree, p, n, point, bucket_dist);
+        for (int i = 0; i < n; i++)
+            if (bucket_dist[i] <= radius_sq)
+                Storage.push_back(frozen_tree.points[p + i]);
+        return;
     }
-    else
+    if (calc_dist(frozen_tree.points[p], point) <= radius_sq)
+        Storage.push_back(frozen_tree.points[p]);
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        Frozen_Search_by_radius(frozen_tree, p + 1, left_num, point, radius_sq, Storage);
+    if (right_num > 0)
+        Frozen_Search_by_radius(frozen_tree, p + 1 + left_num, right_num, point, radius_sq, Storage);
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Frozen_Count_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint)
+{
+    bool contained = true;
+    for (int i = 0; i < 3; i++)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        if (boxpoint.vertex_max[i] <= frozen_tree.range_min[i][p] || boxpoint.vertex_min[i] > frozen_tree.range_max[i][p])
+            return 0;
+        contained = contained && boxpoint.vertex_min[i] <= frozen_tree.range_min[i][p] && boxpoint.vertex_max[i] > frozen_tree.range_max[i][p];
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    if (contained)
+        return n;
+    int count = 0;
+    int point_num = n <= Frozen_Bucket_Size ? n : 1;
+    for (int i = p; i < p + point_num; i++)
     {
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
+        const PointType &point = frozen_tree.points[i];
+        if (boxpoint.vertex_min[0] <= point.x && boxpoint.vertex_max[0] > point.x && boxpoint.vertex_min[1] <= point.y && boxpoint.vertex_max[1] > point.y && boxpoint.vertex_min[2] <= point.z && boxpoint.vertex_max[2] > point.z)
+            count++;
     }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }    
-    return;
+    if (n <= Frozen_Bucket_Size)
+        return count;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        count += Frozen_Count_by_range(frozen_tree, p + 1, left_num, boxpoint);
+    if (right_num > 0)
+        count += Frozen_Count_by_range(frozen_tree, p + 1 + left_num, right_num, boxpoint);
+    return count;
 }
 
 template <typename PointType>
-bool KD_TREE<PointType>::CollisionCheckRecursive(KD_TREE_NODE *root, const PointType &point, const float &radius)
+int KD_TREE<PointType>::Frozen_Count_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq)
 {
-    if (root == nullptr) return false;
-    Push_Down(root);
-    PointType range_center;
-    range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
-    range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
-    range_center.z = (root->node_range_z[0] + root->node_range_z[1]) * 0.5;
-    float dist = std::sqrt(calc_dist(range_center, point));
-    if (dist > radius + std::sqrt(root->radius_sq)) return false;
-    if (dist <= radius - std::sqrt(root->radius_sq)) 
+    if (Frozen_Box_Dist(frozen_tree, p, point) > radius_sq)
+        return 0;
+    if (Frozen_Box_Max_Dist(frozen_tree, p, point) <= radius_sq)
+        return n;
+    int count = 0;
+    if (n <= Frozen_Bucket_Size)
     {
-        return true;
+        float bucket_dist[Frozen_Bucket_Size];
+        Frozen_Bucket_Dist(frozen_tree, p, n, point, bucket_dist);
+        for (int i = 0; i < n; i++)
+            count += (bucket_dist[i] <= radius_sq) ? 1 : 0;
+        return count;
     }
-    if (!root->point_deleted && calc_dist(root->point, point) <= radius * radius){
+    if (calc_dist(frozen_tree.points[p], point) <= radius_sq)
+        count++;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0)
+        count += Frozen_Count_by_radius(frozen_tree, p + 1, left_num, point, radius_sq);
+    if (right_num > 0)
+        count += Frozen_Count_by_radius(frozen_tree, p + 1 + left_num, right_num, point, radius_sq);
+    return count;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Frozen_Collision_Check(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq)
+{
+    if (Frozen_Box_Dist(frozen_tree, p, point) > radius_sq)
+        return false;
+    if (Frozen_Box_Max_Dist(frozen_tree, p, point) <= radius_sq)
         return true;
+    if (n <= Frozen_Bucket_Size)
+    {
+        float bucket_dist[Frozen_Bucket_Size];
+        Frozen_Bucket_Dist(frozen_tree, p, n, point, bucket_dist);
+        for (int i = 0; i < n; i++)
+            if (bucket_dist[i] <= radius_sq)
+                return true;
+        return false;
     }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
+    if (calc_dist(frozen_tree.points[p], point) <= radius_sq)
+        return true;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0 && Frozen_Collision_Check(frozen_tree, p + 1, left_num, point, radius_sq))
+        return true;
+    return right_num > 0 && Frozen_Collision_Check(frozen_tree, p + 1 + left_num, right_num, point, radius_sq);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Frozen_Ray_Cast(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const RAY_QUERY &ray, const float &max_dist, float &hit_dist)
+{
+    // The ray is known to enter the box of p before the current hit
+    int point_num = n <= Frozen_Bucket_Size ? n : 1;
+    for (int i = p; i < p + point_num; i++)
     {
-        if (CollisionCheckRecursive(root->left_son_ptr, point, radius))
-        {
-            return true;
-        }
+        float t = Ray_Point_Entry(ray, frozen_tree.points[i]);
+        if (t <= max_dist && t < hit_dist)
+            hit_dist = t;
     }
-    else
+    if (n <= Frozen_Bucket_Size)
+        return;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    int sons[2] = {p + 1, p + 1 + left_num};
+    int son_num[2] = {left_num, right_num};
+    float bound = std::min(hit_dist, max_dist);
+    float entry[2];
+    for (int s = 0; s < 2; s++)
+        entry[s] = son_num[s] > 0 ? Frozen_Ray_Entry(frozen_tree, ray, sons[s], bound) : INFINITY;
+    int first = entry[1] < entry[0] ? 1 : 0;
+    for (int i = 0; i < 2; i++)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        bool collision_ = CollisionCheckRecursive(root->left_son_ptr, point, radius);
-        pthread_mutex_unlock(&search_flag_mutex);
-        if (collision_)
-        {
-            return true;
-        }
+        int s = i == 0 ? first : 1 - first;
+        if (entry[s] <= std::min(hit_dist, max_dist))
+            Frozen_Ray_Cast(frozen_tree, sons[s], son_num[s], ray, max_dist, hit_dist);
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    return;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Frozen_Segment_Check(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const RAY_QUERY &segment, const float &length, const PointType *excluded)
+{
+    // The segment is known to pass through the box of p inflated by the radius
+    int point_num = n <= Frozen_Bucket_Size ? n : 1;
+    for (int i = p; i < p + point_num; i++)
     {
-        if (CollisionCheckRecursive(root->right_son_ptr, point, radius))
-        {
+        if (Ray_Point_Entry(segment, frozen_tree.points[i]) <= length && (excluded == nullptr || calc_dist(*excluded, frozen_tree.points[i]) > segment.radius_sq))
             return true;
-        }
     }
-    else
+    if (n <= Frozen_Bucket_Size)
+        return false;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    int sons[2] = {p + 1, p + 1 + left_num};
+    int son_num[2] = {left_num, right_num};
+    float entry[2];
+    for (int s = 0; s < 2; s++)
+        entry[s] = son_num[s] > 0 ? Frozen_Ray_Entry(frozen_tree, segment, sons[s], length) : INFINITY;
+    int first = entry[1] < entry[0] ? 1 : 0;
+    for (int i = 0; i < 2; i++)
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        bool collision_ = CollisionCheckRecursive(root->right_son_ptr, point, radius);
-        pthread_mutex_unlock(&search_flag_mutex);
-        if (collision_)
-        {
+        int s = i == 0 ? first : 1 - first;
+        if (entry[s] <= length && Frozen_Segment_Check(frozen_tree, sons[s], son_num[s], segment, length, excluded))
             return true;
-        }
-    }    
+    }
     return false;
 }
 
@@ -1727,11 +3647,14 @@ bool KD_TREE<PointType>::Criterion_Check(KD_TREE_NODE *root)
     if (son_ptr == nullptr)
         son_ptr = root->right_son_ptr;
     delete_evaluation = float(root->invalid_point_num) / root->TreeSize;
-    balance_evaluation = float(son_ptr->TreeSize) / (root->TreeSize - 1);
     if (delete_evaluation > delete_criterion_param)
     {
         return true;
     }
+    // A leaf bucket has no sons to balance
+    if (son_ptr == nullptr)
+        return false;
+    balance_evaluation = float(son_ptr->TreeSize) / (root->TreeSize - 1);
     if (balance_evaluation > balance_criterion_param || balance_evaluation < 1 - balance_criterion_param)
     {
         return true;
@@ -1744,27 +3667,53 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
 {
     if (root == nullptr)
         return;
+    if (root->bucket != nullptr)
+    {
+        // Into the slots of the bucket, as into sons of one point
+        if (root->need_push_down_to_left)
+        {
+            LEAF_BUCKET *bucket = root->bucket;
+            int point_num = bucket->point_num.load(std::memory_order_relaxed);
+            for (int i = 0; i < point_num; i++)
+            {
+                bucket->point_downsample_deleted[i] |= root->tree_downsample_deleted;
+                bucket->point_deleted[i] = root->tree_deleted || bucket->point_downsample_deleted[i];
+            }
+            root->need_push_down_to_left.store_release(false);
+        }
+        return;
+    }
     Operation_Logger_Type operation;
     operation.op = PUSH_DOWN;
     operation.tree_deleted = root->tree_deleted;
     operation.tree_downsample_deleted = root->tree_downsample_deleted;
     if (root->need_push_down_to_left && root->left_son_ptr != nullptr)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
+        int slot_id = Rebuild_Slot_Of(root->left_son_ptr);
+        if (slot_id < 0)
         {
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
             root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
             if (root->tree_downsample_deleted)
+            {
                 root->left_son_ptr->down_del_num = root->left_son_ptr->TreeSize;
+                root->left_son_ptr->covered_down_del_num = root->left_son_ptr->covered_num;
+            }
             if (root->tree_deleted)
+            {
                 root->left_son_ptr->invalid_point_num = root->left_son_ptr->TreeSize;
+                root->left_son_ptr->covered_invalid_num = root->left_son_ptr->covered_num;
+            }
             else
+            {
                 root->left_son_ptr->invalid_point_num = root->left_son_ptr->down_del_num;
+                root->left_son_ptr->covered_invalid_num = root->left_son_ptr->covered_down_del_num;
+            }
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
-            root->need_push_down_to_left = false;
+            root->need_push_down_to_left.store_release(false);
         }
         else
         {
@@ -1774,40 +3723,57 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
             root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
             if (root->tree_downsample_deleted)
+            {
                 root->left_son_ptr->down_del_num = root->left_son_ptr->TreeSize;
+                root->left_son_ptr->covered_down_del_num = root->left_son_ptr->covered_num;
+            }
             if (root->tree_deleted)
+            {
                 root->left_son_ptr->invalid_point_num = root->left_son_ptr->TreeSize;
+                root->left_son_ptr->covered_invalid_num = root->left_son_ptr->covered_num;
+            }
             else
+            {
                 root->left_son_ptr->invalid_point_num = root->left_son_ptr->down_del_num;
+                root->left_son_ptr->covered_invalid_num = root->left_son_ptr->covered_down_del_num;
+            }
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
             }
-            root->need_push_down_to_left = false;
+            root->need_push_down_to_left.store_release(false);
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
     if (root->need_push_down_to_right && root->right_son_ptr != nullptr)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
+        int slot_id = Rebuild_Slot_Of(root->right_son_ptr);
+        if (slot_id < 0)
         {
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
             root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
             if (root->tree_downsample_deleted)
+            {
                 root->right_son_ptr->down_del_num = root->right_son_ptr->TreeSize;
+                root->right_son_ptr->covered_down_del_num = root->right_son_ptr->covered_num;
+            }
             if (root->tree_deleted)
+            {
                 root->right_son_ptr->invalid_point_num = root->right_son_ptr->TreeSize;
+                root->right_son_ptr->covered_invalid_num = root->right_son_ptr->covered_num;
+            }
             else
+            {
                 root->right_son_ptr->invalid_point_num = root->right_son_ptr->down_del_num;
+                root->right_son_ptr->covered_invalid_num = root->right_son_ptr->covered_down_del_num;
+            }
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
-            root->need_push_down_to_right = false;
+            root->need_push_down_to_right.store_release(false);
         }
         else
         {
@@ -1817,20 +3783,27 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
             root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
             if (root->tree_downsample_deleted)
+            {
                 root->right_son_ptr->down_del_num = root->right_son_ptr->TreeSize;
+                root->right_son_ptr->covered_down_del_num = root->right_son_ptr->covered_num;
+            }
             if (root->tree_deleted)
+            {
                 root->right_son_ptr->invalid_point_num = root->right_son_ptr->TreeSize;
+                root->right_son_ptr->covered_invalid_num = root->right_son_ptr->covered_num;
+            }
             else
+            {
                 root->right_son_ptr->invalid_point_num = root->right_son_ptr->down_del_num;
+                root->right_son_ptr->covered_invalid_num = root->right_son_ptr->covered_down_del_num;
+            }
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
-            if (rebuild_flag)
+            if (Rebuild_Slots[slot_id].rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                Rebuild_Slots[slot_id].Rebuild_Logger.push(operation);
             }
-            root->need_push_down_to_right = false;
+            root->need_push_down_to_right.store_release(false);
             pthread_mutex_unlock(&working_flag_mutex);
         }
     }
@@ -1845,135 +3818,110 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
     float tmp_range_x[2] = {INFINITY, -INFINITY};
     float tmp_range_y[2] = {INFINITY, -INFINITY};
     float tmp_range_z[2] = {INFINITY, -INFINITY};
+    bool point_covered = Traits::covered(root->point);
     // Update Tree Size
     if (left_son_ptr != nullptr && right_son_ptr != nullptr)
     {
         root->TreeSize = left_son_ptr->TreeSize + right_son_ptr->TreeSize + 1;
         root->invalid_point_num = left_son_ptr->invalid_point_num + right_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
         root->down_del_num = left_son_ptr->down_del_num + right_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->covered_num = left_son_ptr->covered_num + right_son_ptr->covered_num + (point_covered ? 1 : 0);
+        root->covered_invalid_num = left_son_ptr->covered_invalid_num + right_son_ptr->covered_invalid_num + (point_covered && root->point_deleted ? 1 : 0);
+        root->covered_down_del_num = left_son_ptr->covered_down_del_num + right_son_ptr->covered_down_del_num + (point_covered && root->point_downsample_deleted ? 1 : 0);
         root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
         root->tree_deleted = left_son_ptr->tree_deleted && right_son_ptr->tree_deleted && root->point_deleted;
-        if (root->tree_deleted || (!left_son_ptr->tree_deleted && !right_son_ptr->tree_deleted && !root->point_deleted))
-        {
-            tmp_range_x[0] = std::min(std::min(left_son_ptr->node_range_x[0], right_son_ptr->node_range_x[0]), root->point.x);
-            tmp_range_x[1] = std::max(std::max(left_son_ptr->node_range_x[1], right_son_ptr->node_range_x[1]), root->point.x);
-            tmp_range_y[0] = std::min(std::min(left_son_ptr->node_range_y[0], right_son_ptr->node_range_y[0]), root->point.y);
-            tmp_range_y[1] = std::max(std::max(left_son_ptr->node_range_y[1], right_son_ptr->node_range_y[1]), root->point.y);
-            tmp_range_z[0] = std::min(std::min(left_son_ptr->node_range_z[0], right_son_ptr->node_range_z[0]), root->point.z);
-            tmp_range_z[1] = std::max(std::max(left_son_ptr->node_range_z[1], right_son_ptr->node_range_z[1]), root->point.z);
-        }
-        else
-        {
-            if (!left_son_ptr->tree_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], left_son_ptr->node_range_x[0]);
-                tmp_range_x[1] = std::max(tmp_range_x[1], left_son_ptr->node_range_x[1]);
-                tmp_range_y[0] = std::min(tmp_range_y[0], left_son_ptr->node_range_y[0]);
-                tmp_range_y[1] = std::max(tmp_range_y[1], left_son_ptr->node_range_y[1]);
-                tmp_range_z[0] = std::min(tmp_range_z[0], left_son_ptr->node_range_z[0]);
-                tmp_range_z[1] = std::max(tmp_range_z[1], left_son_ptr->node_range_z[1]);
-            }
-            if (!right_son_ptr->tree_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], right_son_ptr->node_range_x[0]);
-                tmp_range_x[1] = std::max(tmp_range_x[1], right_son_ptr->node_range_x[1]);
-                tmp_range_y[0] = std::min(tmp_range_y[0], right_son_ptr->node_range_y[0]);
-                tmp_range_y[1] = std::max(tmp_range_y[1], right_son_ptr->node_range_y[1]);
-                tmp_range_z[0] = std::min(tmp_range_z[0], right_son_ptr->node_range_z[0]);
-                tmp_range_z[1] = std::max(tmp_range_z[1], right_son_ptr->node_range_z[1]);
-            }
-            if (!root->point_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], root->point.x);
-                tmp_range_x[1] = std::max(tmp_range_x[1], root->point.x);
-                tmp_range_y[0] = std::min(tmp_range_y[0], root->point.y);
-                tmp_range_y[1] = std::max(tmp_range_y[1], root->point.y);
-                tmp_range_z[0] = std::min(tmp_range_z[0], root->point.z);
-                tmp_range_z[1] = std::max(tmp_range_z[1], root->point.z);
-            }
-        }
+        // The box bounds the deleted points too, so restoring them (also lazily) never leaves it stale
+        tmp_range_x[0] = std::min(std::min(left_son_ptr->node_range_x[0], right_son_ptr->node_range_x[0]), root->point.x);
+        tmp_range_x[1] = std::max(std::max(left_son_ptr->node_range_x[1], right_son_ptr->node_range_x[1]), root->point.x);
+        tmp_range_y[0] = std::min(std::min(left_son_ptr->node_range_y[0], right_son_ptr->node_range_y[0]), root->point.y);
+        tmp_range_y[1] = std::max(std::max(left_son_ptr->node_range_y[1], right_son_ptr->node_range_y[1]), root->point.y);
+        tmp_range_z[0] = std::min(std::min(left_son_ptr->node_range_z[0], right_son_ptr->node_range_z[0]), root->point.z);
+        tmp_range_z[1] = std::max(std::max(left_son_ptr->node_range_z[1], right_son_ptr->node_range_z[1]), root->point.z);
     }
     else if (left_son_ptr != nullptr)
     {
         root->TreeSize = left_son_ptr->TreeSize + 1;
         root->invalid_point_num = left_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
         root->down_del_num = left_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->covered_num = left_son_ptr->covered_num + (point_covered ? 1 : 0);
+        root->covered_invalid_num = left_son_ptr->covered_invalid_num + (point_covered && root->point_deleted ? 1 : 0);
+        root->covered_down_del_num = left_son_ptr->covered_down_del_num + (point_covered && root->point_downsample_deleted ? 1 : 0);
         root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
         root->tree_deleted = left_son_ptr->tree_deleted && root->point_deleted;
-        if (root->tree_deleted || (!left_son_ptr->tree_deleted && !root->point_deleted))
-        {
-            tmp_range_x[0] = std::min(left_son_ptr->node_range_x[0], root->point.x);
-            tmp_range_x[1] = std::max(left_son_ptr->node_range_x[1], root->point.x);
-            tmp_range_y[0] = std::min(left_son_ptr->node_range_y[0], root->point.y);
-            tmp_range_y[1] = std::max(left_son_ptr->node_range_y[1], root->point.y);
-            tmp_range_z[0] = std::min(left_son_ptr->node_range_z[0], root->point.z);
-            tmp_range_z[1] = std::max(left_son_ptr->node_range_z[1], root->point.z);
-        }
-        else
-        {
-            if (!left_son_ptr->tree_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], left_son_ptr->node_range_x[0]);
-                tmp_range_x[1] = std::max(tmp_range_x[1], left_son_ptr->node_range_x[1]);
-                tmp_range_y[0] = std::min(tmp_range_y[0], left_son_ptr->node_range_y[0]);
-                tmp_range_y[1] = std::max(tmp_range_y[1], left_son_ptr->node_range_y[1]);
-                tmp_range_z[0] = std::min(tmp_range_z[0], left_son_ptr->node_range_z[0]);
-                tmp_range_z[1] = std::max(tmp_range_z[1], left_son_ptr->node_range_z[1]);
-            }
-            if (!root->point_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], root->point.x);
-                tmp_range_x[1] = std::max(tmp_range_x[1], root->point.x);
-                tmp_range_y[0] = std::min(tmp_range_y[0], root->point.y);
-                tmp_range_y[1] = std::max(tmp_range_y[1], root->point.y);
-                tmp_range_z[0] = std::min(tmp_range_z[0], root->point.z);
-                tmp_range_z[1] = std::max(tmp_range_z[1], root->point.z);
-            }
-        }
+        tmp_range_x[0] = std::min(left_son_ptr->node_range_x[0], root->point.x);
+        tmp_range_x[1] = std::max(left_son_ptr->node_range_x[1], root->point.x);
+        tmp_range_y[0] = std::min(left_son_ptr->node_range_y[0], root->point.y);
+        tmp_range_y[1] = std::max(left_son_ptr->node_range_y[1], root->point.y);
+        tmp_range_z[0] = std::min(left_son_ptr->node_range_z[0], root->point.z);
+        tmp_range_z[1] = std::max(left_son_ptr->node_range_z[1], root->point.z);
     }
     else if (right_son_ptr != nullptr)
     {
         root->TreeSize = right_son_ptr->TreeSize + 1;
         root->invalid_point_num = right_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
         root->down_del_num = right_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->covered_num = right_son_ptr->covered_num + (point_covered ? 1 : 0);
+        root->covered_invalid_num = right_son_ptr->covered_invalid_num + (point_covered && root->point_deleted ? 1 : 0);
+        root->covered_down_del_num = right_son_ptr->covered_down_del_num + (point_covered && root->point_downsample_deleted ? 1 : 0);
         root->tree_downsample_deleted = right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
         root->tree_deleted = right_son_ptr->tree_deleted && root->point_deleted;
-        if (root->tree_deleted || (!right_son_ptr->tree_deleted && !root->point_deleted))
-        {
-            tmp_range_x[0] = std::min(right_son_ptr->node_range_x[0], root->point.x);
-            tmp_range_x[1] = std::max(right_son_ptr->node_range_x[1], root->point.x);
-            tmp_range_y[0] = std::min(right_son_ptr->node_range_y[0], root->point.y);
-            tmp_range_y[1] = std::max(right_son_ptr->node_range_y[1], root->point.y);
-            tmp_range_z[0] = std::min(right_son_ptr->node_range_z[0], root->point.z);
-            tmp_range_z[1] = std::max(right_son_ptr->node_range_z[1], root->point.z);
-        }
-        else
+        tmp_range_x[0] = std::min(right_son_ptr->node_range_x[0], root->point.x);
+        tmp_range_x[1] = std::max(right_son_ptr->node_range_x[1], root->point.x);
+        tmp_range_y[0] = std::min(right_son_ptr->node_range_y[0], root->point.y);
+        tmp_range_y[1] = std::max(right_son_ptr->node_range_y[1], root->point.y);
+        tmp_range_z[0] = std::min(right_son_ptr->node_range_z[0], root->point.z);
+        tmp_range_z[1] = std::max(right_son_ptr->node_range_z[1], root->point.z);
+    }
+    else if (root->bucket != nullptr)
+    {
+        // A leaf with a bucket, Push_Down has brought the labels of its slots up to date
+        LEAF_BUCKET *bucket = root->bucket;
+        int point_num = bucket->point_num.load(std::memory_order_relaxed);
+        int invalid_num = (root->point_deleted ? 1 : 0);
+        int down_del_num = (root->point_downsample_deleted ? 1 : 0);
+        int covered_num = (point_covered ? 1 : 0);
+        int covered_invalid_num = (point_covered && root->point_deleted ? 1 : 0);
+        int covered_down_del_num = (point_covered && root->point_downsample_deleted ? 1 : 0);
+        bool tree_deleted = root->point_deleted, tree_downsample_deleted = root->point_downsample_deleted;
+        tmp_range_x[0] = tmp_range_x[1] = root->point.x;
+        tmp_range_y[0] = tmp_range_y[1] = root->point.y;
+        tmp_range_z[0] = tmp_range_z[1] = root->point.z;
+        for (int i = 0; i < point_num; i++)
         {
-            if (!right_son_ptr->tree_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], right_son_ptr->node_range_x[0]);
-                tmp_range_x[1] = std::max(tmp_range_x[1], right_son_ptr->node_range_x[1]);
-                tmp_range_y[0] = std::min(tmp_range_y[0], right_son_ptr->node_range_y[0]);
-                tmp_range_y[1] = std::max(tmp_range_y[1], right_son_ptr->node_range_y[1]);
-                tmp_range_z[0] = std::min(tmp_range_z[0], right_son_ptr->node_range_z[0]);
-                tmp_range_z[1] = std::max(tmp_range_z[1], right_son_ptr->node_range_z[1]);
-            }
-            if (!root->point_deleted)
-            {
-                tmp_range_x[0] = std::min(tmp_range_x[0], root->point.x);
-                tmp_range_x[1] = std::max(tmp_range_x[1], root->point.x);
-                tmp_range_y[0] = std::min(tmp_range_y[0], root->point.y);
-                tmp_range_y[1] = std::max(tmp_range_y[1], root->point.y);
-                tmp_range_z[0] = std::min(tmp_range_z[0], root->point.z);
-                tmp_range_z[1] = std::max(tmp_range_z[1], root->point.z);
-            }
+            bool deleted = bucket->point_deleted[i];
+            bool downsample_deleted = bucket->point_downsample_deleted[i];
+            bool covered = Traits::covered(bucket->points[i]);
+            invalid_num += (deleted ? 1 : 0);
+            down_del_num += (downsample_deleted ? 1 : 0);
+            covered_num += (covered ? 1 : 0);
+            covered_invalid_num += (covered && deleted ? 1 : 0);
+            covered_down_del_num += (covered && downsample_deleted ? 1 : 0);
+            tree_deleted = tree_deleted && deleted;
+            tree_downsample_deleted = tree_downsample_deleted && downsample_deleted;
+            tmp_range_x[0] = std::min(tmp_range_x[0], bucket->coord[0][i]);
+            tmp_range_x[1] = std::max(tmp_range_x[1], bucket->coord[0][i]);
+            tmp_range_y[0] = std::min(tmp_range_y[0], bucket->coord[1][i]);
+            tmp_range_y[1] = std::max(tmp_range_y[1], bucket->coord[1][i]);
+            tmp_range_z[0] = std::min(tmp_range_z[0], bucket->coord[2][i]);
+            tmp_range_z[1] = std::max(tmp_range_z[1], bucket->coord[2][i]);
         }
+        root->TreeSize = point_num + 1;
+        root->invalid_point_num = invalid_num;
+        root->down_del_num = down_del_num;
+        root->covered_num = covered_num;
+        root->covered_invalid_num = covered_invalid_num;
+        root->covered_down_del_num = covered_down_del_num;
+        root->tree_downsample_deleted = tree_downsample_deleted;
+        root->tree_deleted = tree_deleted;
     }
     else
     {
         root->TreeSize = 1;
         root->invalid_point_num = (root->point_deleted ? 1 : 0);
         root->down_del_num = (root->point_downsample_deleted ? 1 : 0);
+        root->covered_num = (point_covered ? 1 : 0);
+        root->covered_invalid_num = (point_covered && root->point_deleted ? 1 : 0);
+        root->covered_down_del_num = (point_covered && root->point_downsample_deleted ? 1 : 0);
         root->tree_downsample_deleted = root->point_downsample_deleted;
         root->tree_deleted = root->point_deleted;
         tmp_range_x[0] = root->point.x;
@@ -1986,10 +3934,6 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
     memcpy(root->node_range_x, tmp_range_x, sizeof(tmp_range_x));
     memcpy(root->node_range_y, tmp_range_y, sizeof(tmp_range_y));
     memcpy(root->node_range_z, tmp_range_z, sizeof(tmp_range_z));
-    float x_L = (root->node_range_x[1] - root->node_range_x[0]) * 0.5;
-    float y_L = (root->node_range_y[1] - root->node_range_y[0]) * 0.5;
-    float z_L = (root->node_range_z[1] - root->node_range_z[0]) * 0.5;
-    root->radius_sq = x_L*x_L + y_L * y_L + z_L * z_L;
     if (left_son_ptr != nullptr)
         left_son_ptr->father_ptr = root;
     if (right_son_ptr != nullptr)
@@ -1999,37 +3943,53 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
         KD_TREE_NODE *son_ptr = root->left_son_ptr;
         if (son_ptr == nullptr)
             son_ptr = root->right_son_ptr;
-        float tmp_bal = float(son_ptr->TreeSize) / (root->TreeSize - 1);
-        root->alpha_del = float(root->invalid_point_num) / root->TreeSize;
-        root->alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
+        // A leaf bucket has no sons to balance
+        float tmp_bal = (son_ptr != nullptr) ? float(son_ptr->TreeSize) / (root->TreeSize - 1) : 0.5f;
+        root_alpha_del = float(root->invalid_point_num) / root->TreeSize;
+        root_alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
     }
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type)
+void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type, const LAZY_LABELS &father_labels)
 {
     if (root == nullptr)
         return;
-    Push_Down(root);
-    if (!root->point_deleted)
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (!labels.point_deleted)
     {
         Storage.push_back(root->point);
     }
-    flatten(root->left_son_ptr, Storage, storage_type);
-    flatten(root->right_son_ptr, Storage, storage_type);
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+        {
+            if (!Slot_Deleted(bucket, i, slot_labels))
+                Storage.push_back(bucket->points[i]);
+            else if (!Slot_Downsample_Deleted(bucket, i, slot_labels) && storage_type == DELETE_POINTS_REC)
+                Points_deleted.push_back(bucket->points[i]);
+            else if (!Slot_Downsample_Deleted(bucket, i, slot_labels) && storage_type == MULTI_THREAD_REC)
+                Multithread_Points_deleted.push_back(bucket->points[i]);
+        }
+    }
+    flatten(root->left_son_ptr, Storage, storage_type, Son_Labels(labels, root->need_push_down_to_left));
+    flatten(root->right_son_ptr, Storage, storage_type, Son_Labels(labels, root->need_push_down_to_right));
     switch (storage_type)
     {
         case NOT_RECORD:
             break;
         case DELETE_POINTS_REC:
-            if (root->point_deleted && !root->point_downsample_deleted)
+            if (labels.point_deleted && !labels.point_downsample_deleted)
             {
                 Points_deleted.push_back(root->point);
             }
             break;
         case MULTI_THREAD_REC:
-            if (root->point_deleted && !root->point_downsample_deleted)
+            if (labels.point_deleted && !labels.point_downsample_deleted)
             {
                 Multithread_Points_deleted.push_back(root->point);
             }
@@ -2045,14 +4005,191 @@ void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
 {
     if (*root == nullptr)
         return;
-    Push_Down(*root);
-    delete_tree_nodes(&(*root)->left_son_ptr);
-    delete_tree_nodes(&(*root)->right_son_ptr);
-
-    pthread_mutex_destroy(&(*root)->push_down_mutex_lock);
-    delete *root;
+    // Readers may still be inside: the subtree is unlinked but kept intact until no reader can reach it
+    KD_TREE_NODE *old_root_node = *root;
     *root = nullptr;
+    pthread_mutex_lock(&retire_mutex_lock);
+    Retire_Nodes(old_root_node, Epoch.current());
+    pthread_mutex_unlock(&retire_mutex_lock);
+    Reclaim_Nodes(false);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Retire_Nodes(KD_TREE_NODE *root, const uint64_t &epoch)
+{
+    if (root == nullptr)
+        return;
+    Retire_Nodes(root->left_son_ptr, epoch);
+    Retire_Nodes(root->right_son_ptr, epoch);
+    Retired_Nodes.push_back(RETIRED_NODE{root, epoch});
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Reclaim_Nodes(const bool &force)
+{
+    // Frees the retired nodes older than every reader, once at least Retired_Reclaim_Num are waiting, and the
+    // retired frozen layouts as soon as possible. Both lists are ordered by epoch, so the freed ones are a prefix
+    pthread_mutex_lock(&retire_mutex_lock);
+    if (force || int(Retired_Nodes.size()) >= Retired_Reclaim_Num || !Retired_Frozen.empty())
+    {
+        uint64_t oldest = Epoch.advance();
+        size_t reclaim_num = 0;
+        while (reclaim_num < Retired_Nodes.size() && (force || Retired_Nodes[reclaim_num].epoch < oldest))
+            Release_Node(Retired_Nodes[reclaim_num++].node);
+        Retired_Nodes.erase(Retired_Nodes.begin(), Retired_Nodes.begin() + reclaim_num);
+        reclaim_num = 0;
+        while (reclaim_num < Retired_Frozen.size() && (force || Retired_Frozen[reclaim_num].epoch < oldest))
+            Frozen_Free(Retired_Frozen[reclaim_num++].frozen_tree);
+        Retired_Frozen.erase(Retired_Frozen.begin(), Retired_Frozen.begin() + reclaim_num);
+    }
+    pthread_mutex_unlock(&retire_mutex_lock);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Release_Node(KD_TREE_NODE *node)
+{
+    if (node->bucket != nullptr)
+    {
+        node->bucket->~LEAF_BUCKET();
+        free(node->bucket);
+    }
+    Node_Pool.release(node);
+    return;
+}
+
+template <typename PointType>
+int64_t KD_TREE<PointType>::voxel_key(const PointType &point)
+{
+    // 21 bits per axis, the same grid as the downsampling in Add_Points
+    int64_t x_key = int(point.x * inv_downsample_size) - std::signbit(point.x);
+    int64_t y_key = int(point.y * inv_downsample_size) - std::signbit(point.y);
+    int64_t z_key = int(point.z * inv_downsample_size) - std::signbit(point.z);
+    return ((x_key & 0x1FFFFF) << 42) | ((y_key & 0x1FFFFF) << 21) | (z_key & 0x1FFFFF);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::on_rebuild_thread()
+{
+    for (int i = 0; i < Rebuild_Slot_Num; i++)
+    {
+        if (pthread_equal(pthread_self(), Rebuild_Slots[i].rebuild_thread))
+            return true;
+    }
+    return false;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::voxel_occupancy_tracked()
+{
+    // Operations replayed by the rebuild threads were already counted when they were applied to the original tree
+    return Voxel_Occupancy_On && !on_rebuild_thread();
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Occupancy_Init()
+{
+    // Counts the valid points once, on the first Add_Points with downsample_on. Read only, so the
+    // epoch keeps the subtrees a rebuild thread swaps out meanwhile alive
+    if (Voxel_Occupancy_On)
+        return;
+    Voxel_Occupancy.clear();
+    int reader = Epoch.enter();
+    auto count_point = [this](const PointType &point)
+    {
+        Voxel_Occupancy[voxel_key(point)]++;
+        return true;
+    };
+    Visit_Subtree(Root_Node, count_point, LAZY_LABELS());
+    Epoch.leave(reader);
+    Voxel_Occupancy_On = true;
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Occupancy_Reset()
+{
+    Voxel_Occupancy_On = false;
+    unordered_map<int64_t, int>().swap(Voxel_Occupancy);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Occupancy_Insert(const PointType &point)
+{
+    if (!voxel_occupancy_tracked())
+        return;
+    Voxel_Occupancy[voxel_key(point)]++;
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Occupancy_Erase(const PointType &point)
+{
+    if (!voxel_occupancy_tracked())
+        return;
+    auto iter = Voxel_Occupancy.find(voxel_key(point));
+    if (iter == Voxel_Occupancy.end())
+        return;
+    if (--iter->second <= 0)
+        Voxel_Occupancy.erase(iter);
+    return;
+}
 
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Occupancy_Update_Subtree(KD_TREE_NODE *root, const bool &insert_restored, const LAZY_LABELS &father_labels)
+{
+    // insert_restored: count the points a whole-subtree Add_by_range is about to restore
+    // otherwise: drop the valid points a whole-subtree Delete_by_range is about to delete
+    // Read only, the labels are worked out as the readers do. A son under rebuild is walked under
+    // working_flag_mutex like any writer inside it, so its flatten and swap cannot run meanwhile
+    if (root == nullptr || !voxel_occupancy_tracked())
+        return;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (insert_restored)
+    {
+        if (labels.tree_downsample_deleted)
+            return;
+        if (labels.point_deleted && !labels.point_downsample_deleted)
+            Voxel_Occupancy_Insert(root->point);
+    }
+    else
+    {
+        if (labels.tree_deleted)
+            return;
+        if (!labels.point_deleted)
+            Voxel_Occupancy_Erase(root->point);
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_relaxed);
+        for (int i = 0; i < point_num; i++)
+        {
+            bool deleted = Slot_Deleted(bucket, i, slot_labels);
+            if (insert_restored && deleted && !Slot_Downsample_Deleted(bucket, i, slot_labels))
+                Voxel_Occupancy_Insert(bucket->points[i]);
+            else if (!insert_restored && !deleted)
+                Voxel_Occupancy_Erase(bucket->points[i]);
+        }
+    }
+    KD_TREE_NODE **links[2] = {&root->left_son_ptr, &root->right_son_ptr};
+    LAZY_LABELS son_labels[2] = {Son_Labels(labels, root->need_push_down_to_left), Son_Labels(labels, root->need_push_down_to_right)};
+    for (int s = 0; s < 2; s++)
+    {
+        if (Rebuild_Slot_Of(*links[s]) < 0)
+        {
+            Voxel_Occupancy_Update_Subtree(*links[s], insert_restored, son_labels[s]);
+            continue;
+        }
+        // The link is read again under the lock, the swap may have replaced the son before it
+        pthread_mutex_lock(&working_flag_mutex);
+        Voxel_Occupancy_Update_Subtree(*links[s], insert_restored, son_labels[s]);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
     return;
 }
 
@@ -2062,6 +4199,17 @@ bool KD_TREE<PointType>::same_point(const PointType &a, const PointType &b)
     return (std::fabs(a.x - b.x) < EPSS && std::fabs(a.y - b.y) < EPSS && std::fabs(a.z - b.z) < EPSS);
 }
 
+template <typename PointType>
+bool KD_TREE<PointType>::box_contains(const BoxPointType &outer, const BoxPointType &inner)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        if (inner.vertex_min[k] < outer.vertex_min[k] || inner.vertex_max[k] > outer.vertex_max[k])
+            return false;
+    }
+    return true;
+}
+
 template <typename PointType>
 float KD_TREE<PointType>::calc_dist(const PointType &a, const PointType &b)
 {
@@ -2090,6 +4238,16 @@ float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, const PointType &poi
         min_dist += (point.z - node->node_range_z[1]) * (point.z - node->node_range_z[1]);
     return min_dist;
 }
+
+template <typename PointType>
+float KD_TREE<PointType>::calc_box_max_dist(KD_TREE_NODE *node, const PointType &point)
+{
+    // Squared distance to the farthest corner of the node box
+    float dx = std::max(point.x - node->node_range_x[0], node->node_range_x[1] - point.x);
+    float dy = std::max(point.y - node->node_range_y[0], node->node_range_y[1] - point.y);
+    float dz = std::max(point.z - node->node_range_z[0], node->node_range_z[1] - point.z);
+    return dx * dx + dy * dy + dz * dz;
+}
 template <typename PointType>
 bool KD_TREE<PointType>::point_cmp_x(const PointType &a, const PointType &b) { return a.x < b.x; }
 template <typename PointType>
@@ -2098,5 +4256,12 @@ template <typename PointType>
 bool KD_TREE<PointType>::point_cmp_z(const PointType &a, const PointType &b) { return a.z < b.z; }
 
 
-// Manual Instatiations
-template class KD_TREE<PointType_Coverage>;
\ No newline at end of file
+// Manual Instatiations, IKD_TREE_HEADER_ONLY builds instantiate from the header instead
+#ifndef IKD_TREE_HEADER_ONLY
+template class KD_TREE<PointType_Coverage>;
+template class KD_TREE<pcl::PointXYZ>;
+template class KD_TREE<pcl::PointXYZI>;
+template class KD_TREE<pcl::PointXYZINormal>;
+template class KD_TREE<pcl::PointXYZRGB>;
+template class KD_TREE<pcl::PointNormal>;
+#endif
\ No newline at end of file
@@ -8,13 +8,44 @@
 #include <math.h>
 #include <algorithm>
 #include <memory.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <functional>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include <typeinfo>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcl/point_types.h>
+#include <Eigen/Core>
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
 #define ForceRebuildPercentage 0.2
 #define Q_LEN 1000000
+#define Q_Chunk_Len 1024
+#define Replay_Batch_Num 4096
+#define Parallel_Point_Num 20000
+#define Small_K_Nearest 16
+#define Node_Pool_Slab_Bytes (1 << 18)
+#define Node_Pool_Empty_Slab_Num 4
+#define Frozen_Bucket_Size 16
+#define Leaf_Bucket_Max 32
+#define Snapshot_Version 2
+#define Snapshot_Header_Bytes 64
+#define Rebuild_Slot_Num 2
+#define Epoch_Reader_Num 64
+#define Retired_Reclaim_Num 4096
 
 using namespace std;
 
@@ -32,6 +63,26 @@ struct PointType_Coverage //pcl::PointXYZ + coverage, if want to use PointXYZI o
     }
 };
 
+// How the tree reads the covered flag of a point type: the covered member if the type has one (as
+// PointType_Coverage), none otherwise (PCL point types). Without it Set_Covered_* mark nothing and every
+// point is uncovered. Coordinates are always the x, y, z members and the rest of the point (intensity,
+// normal, ...) is kept as it is. Specialize it for a point type that keeps the flag elsewhere
+template <typename PointType, typename Enable = void>
+struct IKD_POINT_TRAITS
+{
+    static const bool has_coverage = false;
+    static bool covered(const PointType &) { return false; }
+    static void set_covered(PointType &, const bool &) {}
+};
+
+template <typename PointType>
+struct IKD_POINT_TRAITS<PointType, decltype(void(std::declval<PointType &>().covered))>
+{
+    static const bool has_coverage = true;
+    static bool covered(const PointType &point) { return point.covered; }
+    static void set_covered(PointType &point, const bool &covered_flag) { point.covered = covered_flag; }
+};
+
 struct BoxPointType
 {
     float vertex_min[3];
@@ -45,7 +96,8 @@ enum operation_set
     DELETE_BOX,
     ADD_BOX,
     DOWNSAMPLE_DELETE,
-    PUSH_DOWN
+    PUSH_DOWN,
+    SET_COVERED
 };
 
 enum delete_point_storage_set
@@ -65,30 +117,176 @@ class KD_TREE
 public:
     using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
     using Ptr = std::shared_ptr<KD_TREE<PointType>>;
+    using Traits = IKD_POINT_TRAITS<PointType>;
     
+    // A node label in its own atomic byte: the writer stores labels while queries read them.
+    // Push_Down clears a need_push_down label with store_release after writing the son's labels and
+    // counts, queries read it with load_acquire, so a query that sees it cleared sees the pushed son
+    struct NODE_LABEL
+    {
+        std::atomic<bool> value;
+        operator bool() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+        NODE_LABEL &operator=(const bool &label)
+        {
+            value.store(label, std::memory_order_relaxed);
+            return *this;
+        }
+        NODE_LABEL &operator=(const NODE_LABEL &label)
+        {
+            return *this = bool(label);
+        }
+        NODE_LABEL &operator|=(const bool &label)
+        {
+            if (label)
+                value.store(true, std::memory_order_relaxed);
+            return *this;
+        }
+        void store_release(const bool &label)
+        {
+            value.store(label, std::memory_order_release);
+        }
+        bool load_acquire() const
+        {
+            return value.load(std::memory_order_acquire);
+        }
+    };
+
+    // Points a leaf keeps besides its own while leaf buckets are on (see set_leaf_bucket_size), with their
+    // coordinates in structure of arrays for Bucket_Dist. A slot is filled before point_num counts it (release)
+    // and never moves, a full bucket is split into a new subtree instead. The labels of the leaf cover its
+    // bucket, need_push_down_to_left of the leaf is set while they are not pushed into the slots yet
+    struct LEAF_BUCKET
+    {
+        float coord[3][Leaf_Bucket_Max];
+        PointType points[Leaf_Bucket_Max];
+        NODE_LABEL point_deleted[Leaf_Bucket_Max];
+        NODE_LABEL point_downsample_deleted[Leaf_Bucket_Max];
+        std::atomic<int> point_num;
+    };
+
     struct KD_TREE_NODE
     {
+        // Hot part, read by every traversal
         PointType point;
-        int division_axis;
+        float node_range_x[2], node_range_y[2], node_range_z[2];
+        KD_TREE_NODE *left_son_ptr = nullptr;
+        KD_TREE_NODE *right_son_ptr = nullptr;
+        // Only on leaves, see LEAF_BUCKET
+        LEAF_BUCKET *bucket = nullptr;
+        uint8_t division_axis;
+        // Set on the nodes a writer (or a sensor worker) is working on, the rebuild thread reads it
+        NODE_LABEL working_flag;
+        // Set by InitTreeNode
+        NODE_LABEL point_deleted;
+        NODE_LABEL tree_deleted;
+        NODE_LABEL point_downsample_deleted;
+        NODE_LABEL tree_downsample_deleted;
+        NODE_LABEL need_push_down_to_left;
+        NODE_LABEL need_push_down_to_right;
+        // Cold part, maintenance counters
         int TreeSize = 1;
         int invalid_point_num = 0;
         int down_del_num = 0;
-        bool point_deleted = false;
+        // Covered points of the subtree: all of them, the deleted and the downsample deleted ones
+        int covered_num = 0;
+        int covered_invalid_num = 0;
+        int covered_down_del_num = 0;
+        KD_TREE_NODE *father_ptr = nullptr;
+    };
+
+    // Lazy labels a query carries down instead of calling Push_Down, so it never writes to the tree.
+    // pushed: an ancestor still has labels to push into this subtree, they override the stored ones
+    struct LAZY_LABELS
+    {
+        bool pushed = false;
         bool tree_deleted = false;
-        bool point_downsample_deleted = false;
         bool tree_downsample_deleted = false;
-        bool need_push_down_to_left = false;
-        bool need_push_down_to_right = false;
-        bool working_flag = false;
-        pthread_mutex_t push_down_mutex_lock;
-        float node_range_x[2], node_range_y[2], node_range_z[2];
+        bool point_deleted = false;
+        bool point_downsample_deleted = false;
+    };
+
+    // Read-only snapshot made by Freeze, the nodes of a median split tree in pre-order:
+    // the subtree of node p with n points is [p, p + n), its left son is p + 1 with (n - 1) / 2 points
+    // and its right son follows the left subtree. Subtrees of at most Frozen_Bucket_Size points are leaf
+    // buckets, scanned as a whole. Points, coordinates, boxes (structure of arrays) and the covered count
+    // of each subtree share one block, which holds no pointers so Save_Snapshot writes it as it is
+    struct FROZEN_TREE
+    {
+        int node_num = 0;
+        char *block = nullptr;
+        size_t block_bytes = 0;
+        // Set when block lies in a file mapped by Load_Snapshot
+        char *map_base = nullptr;
+        size_t map_bytes = 0;
+        PointType *points = nullptr;
+        float *coord[3] = {nullptr, nullptr, nullptr};
+        float *range_min[3] = {nullptr, nullptr, nullptr};
+        float *range_max[3] = {nullptr, nullptr, nullptr};
+        int *covered_num = nullptr;
+    };
+
+    // First Snapshot_Header_Bytes of a snapshot file, the frozen block follows. Files are read back
+    // only with the same point type and layout, on a machine of the same byte order. The point type is
+    // told apart by its size, the offsets of x, y, z, whether (and in which byte) it keeps the covered flag
+    // and a hash of its mangled name, which is stable across builds with the same compiler ABI
+    struct SNAPSHOT_HEADER
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t point_bytes;
+        uint32_t bucket_size;
+        int32_t node_num;
+        uint64_t block_bytes;
+        uint32_t has_coverage;
+        uint32_t coord_offset[3];
+        uint32_t covered_offset;
+        uint64_t type_hash;
+    };
+    static_assert(sizeof(SNAPSHOT_HEADER) <= Snapshot_Header_Bytes, "SNAPSHOT_HEADER must fit in Snapshot_Header_Bytes");
+
+    // Split of one BuildTree range found by Arrange_Storage, stored in pre-order like the nodes
+    struct ARRANGED_SPLIT
+    {
+        int split;
+        uint8_t division_axis;
+    };
+
+    // Ray of Ray_Cast (and segment of CollisionLineCheck): unit direction, its inverse for the slab tests
+    // and the radius points are inflated by
+    struct RAY_QUERY
+    {
+        float origin[3];
+        float dir[3];
+        float inv_dir[3];
+        float radius;
         float radius_sq;
-        KD_TREE_NODE *left_son_ptr = nullptr;
-        KD_TREE_NODE *right_son_ptr = nullptr;
-        KD_TREE_NODE *father_ptr = nullptr;
-        // For paper data record
-        float alpha_del;
-        float alpha_bal;
+    };
+
+    // Sensor of Set_Covered_By_Sensor: rows of rotation are its axes (x forward, y left, z up) in the tree frame.
+    // A point is seen within max_range, at most half fov_h off the x axis around z and half fov_v above or below
+    struct SENSOR_QUERY
+    {
+        float origin[3];
+        float rotation[3][3];
+        float cos_h, sin_h, tan_v;
+        // fov_h < pi: the horizontal wedge is convex, fov_h >= 2 pi: no horizontal limit
+        bool wedge_convex, wedge_full;
+        // fov_v < pi: points above or below the vertical cone are not seen
+        bool cone_limited;
+        float max_range_sq;
+    };
+
+    // What Sensor_Split or one worker of Set_Covered_By_Sensor leaves to the calling thread
+    struct SENSOR_TASK
+    {
+        // Subtrees of the rebuild slots, marked by the calling thread
+        vector<KD_TREE_NODE **> deferred;
+        // Nodes with newly covered points below them, sons before fathers. They keep the working_flag
+        // until the calling thread has updated them, so the rebuild thread never updates them meanwhile
+        vector<KD_TREE_NODE *> updates;
     };
 
     struct Operation_Logger_Type
@@ -134,6 +332,16 @@ public:
         {
             delete[] heap;
         }
+        void reserve(int max_capacity)
+        {
+            if (max_capacity <= cap)
+                return;
+            delete[] heap;
+            cap = max_capacity;
+            heap = new PointType_CMP[max_capacity];
+            heap_size = 0;
+            return;
+        }
         void pop()
         {
             if (heap_size == 0)
@@ -210,113 +418,786 @@ public:
         int cap = 0;
     };
 
+    // Same interface as MANUAL_HEAP for k <= Small_K_Nearest: a sorted array on the stack, no allocation
+    class MANUAL_SMALL_HEAP
+    {
+    public:
+        void pop()
+        {
+            if (heap_size > 0)
+                heap_size--;
+            return;
+        }
+        PointType_CMP top()
+        {
+            return heap[heap_size - 1];
+        }
+        void push(PointType_CMP point)
+        {
+            if (heap_size >= Small_K_Nearest)
+                return;
+            int i = heap_size;
+            while (i > 0 && point < heap[i - 1])
+            {
+                heap[i] = heap[i - 1];
+                i--;
+            }
+            heap[i] = point;
+            heap_size++;
+            return;
+        }
+        int size()
+        {
+            return heap_size;
+        }
+        void clear()
+        {
+            heap_size = 0;
+            return;
+        }
+
+    private:
+        PointType_CMP heap[Small_K_Nearest];
+        int heap_size = 0;
+    };
+
+    // Operations missed by a background rebuild, single producer (writer) and single consumer (rebuild thread).
+    // Grows in chunks of Q_Chunk_Len so it only holds what is pending, and refuses pushes past Q_LEN operations.
     class MANUAL_Q
     {
     private:
-        int head = 0, tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
-        bool is_empty;
+        struct Q_CHUNK
+        {
+            Operation_Logger_Type q[Q_Chunk_Len];
+            std::atomic<Q_CHUNK *> next{nullptr};
+        };
+        // Consumer side
+        Q_CHUNK *head_chunk = nullptr;
+        int head = 0;
+        // Producer side
+        Q_CHUNK *tail_chunk = nullptr;
+        int tail = 0;
+        std::atomic<int> counter{0};
+        std::atomic<bool> overflow{false};
 
     public:
+        MANUAL_Q() = default;
+        MANUAL_Q(const MANUAL_Q &) = delete;
+        MANUAL_Q &operator=(const MANUAL_Q &) = delete;
+        ~MANUAL_Q()
+        {
+            clear();
+        }
         void pop()
         {
-            if (counter == 0)
+            if (counter.load(std::memory_order_acquire) == 0)
                 return;
             head++;
-            head %= Q_LEN;
-            counter--;
-            if (counter == 0)
-                is_empty = true;
+            counter.fetch_sub(1, std::memory_order_release);
             return;
         }
         Operation_Logger_Type front()
         {
-            return q[head];
-        }
-        Operation_Logger_Type back()
-        {
-            return q[tail];
+            // The producer links the next chunk before counting its first operation
+            if (head == Q_Chunk_Len)
+            {
+                Q_CHUNK *next = head_chunk->next.load(std::memory_order_acquire);
+                delete head_chunk;
+                head_chunk = next;
+                head = 0;
+            }
+            return head_chunk->q[head];
         }
+        // Not safe against a concurrent push or pop
         void clear()
         {
-            head = 0;
-            tail = 0;
-            counter = 0;
-            is_empty = true;
+            Q_CHUNK *chunk = head_chunk;
+            while (chunk != nullptr)
+            {
+                Q_CHUNK *next = chunk->next.load(std::memory_order_relaxed);
+                delete chunk;
+                chunk = next;
+            }
+            head_chunk = tail_chunk = nullptr;
+            head = tail = 0;
+            counter.store(0, std::memory_order_relaxed);
+            overflow.store(false, std::memory_order_relaxed);
             return;
         }
-        void push(Operation_Logger_Type op)
+        // False if the log is full, the operation is dropped and overflowed() is set
+        bool push(const Operation_Logger_Type &op)
         {
-            q[tail] = op;
-            counter++;
-            if (is_empty)
-                is_empty = false;
-            tail++;
-            tail %= Q_LEN;
-            return;
+            if (counter.load(std::memory_order_acquire) >= Q_LEN)
+            {
+                overflow.store(true, std::memory_order_release);
+                return false;
+            }
+            if (tail_chunk == nullptr)
+            {
+                // The consumer only reads head_chunk once counter is non-zero
+                head_chunk = tail_chunk = new Q_CHUNK;
+                head = tail = 0;
+            }
+            else if (tail == Q_Chunk_Len)
+            {
+                Q_CHUNK *chunk = new Q_CHUNK;
+                tail_chunk->next.store(chunk, std::memory_order_release);
+                tail_chunk = chunk;
+                tail = 0;
+            }
+            tail_chunk->q[tail++] = op;
+            counter.fetch_add(1, std::memory_order_release);
+            return true;
         }
         bool empty()
         {
-            return is_empty;
+            return counter.load(std::memory_order_acquire) == 0;
+        }
+        int size()
+        {
+            return counter.load(std::memory_order_acquire);
+        }
+        bool overflowed()
+        {
+            return overflow.load(std::memory_order_acquire);
+        }
+    };
+
+    // Epoch based reclamation. Readers announce the epoch they started in, unlinked nodes are retired with the
+    // current epoch and freed once every announced epoch is newer, so readers never block on the writer.
+    class MANUAL_EPOCH
+    {
+    public:
+        MANUAL_EPOCH()
+        {
+            global_epoch.store(1);
+            waiting_num.store(0);
+            for (int i = 0; i < Epoch_Reader_Num; i++)
+                readers[i].epoch.store(0);
+            pthread_mutex_init(&slot_mutex_lock, NULL);
+            pthread_cond_init(&slot_cond, NULL);
+        }
+        ~MANUAL_EPOCH()
+        {
+            pthread_mutex_destroy(&slot_mutex_lock);
+            pthread_cond_destroy(&slot_cond);
+        }
+        // Returns the reader slot to leave, nested readers take their own slots
+        int enter()
+        {
+            int i = std::hash<std::thread::id>()(std::this_thread::get_id()) % Epoch_Reader_Num;
+            uint64_t epoch = global_epoch.load();
+            if (!take_slot(i, epoch))
+            {
+                // All slots are busy: sleep until a reader leaves. Waiters are counted before the
+                // slots are scanned again, so a leave either frees a slot the scan finds or signals
+                pthread_mutex_lock(&slot_mutex_lock);
+                waiting_num.fetch_add(1);
+                while (!take_slot(i, epoch))
+                    pthread_cond_wait(&slot_cond, &slot_mutex_lock);
+                waiting_num.fetch_sub(1);
+                pthread_mutex_unlock(&slot_mutex_lock);
+            }
+            // A reclaim that ran before the announcement must not have advanced past it
+            uint64_t current = global_epoch.load();
+            while (current != epoch)
+            {
+                epoch = current;
+                readers[i].epoch.store(epoch);
+                current = global_epoch.load();
+            }
+            return i;
+        }
+        void leave(const int &reader)
+        {
+            readers[reader].epoch.store(0);
+            if (waiting_num.load() > 0)
+            {
+                pthread_mutex_lock(&slot_mutex_lock);
+                pthread_cond_broadcast(&slot_cond);
+                pthread_mutex_unlock(&slot_mutex_lock);
+            }
+        }
+        uint64_t current()
+        {
+            return global_epoch.load();
+        }
+        // Starts a new epoch and returns the oldest one a reader may still be in
+        uint64_t advance()
+        {
+            uint64_t oldest = global_epoch.fetch_add(1) + 1;
+            for (int i = 0; i < Epoch_Reader_Num; i++)
+            {
+                uint64_t epoch = readers[i].epoch.load();
+                if (epoch != 0 && epoch < oldest)
+                    oldest = epoch;
+            }
+            return oldest;
+        }
+
+    private:
+        // One cache line per reader
+        struct EPOCH_READER
+        {
+            std::atomic<uint64_t> epoch;
+            char padding[64 - sizeof(std::atomic<uint64_t>)];
+        };
+        std::atomic<uint64_t> global_epoch;
+        EPOCH_READER readers[Epoch_Reader_Num];
+        std::atomic<int> waiting_num;
+        pthread_mutex_t slot_mutex_lock;
+        pthread_cond_t slot_cond;
+        // Tries every slot once starting from slot, announcing epoch in the first idle one
+        bool take_slot(int &slot, const uint64_t &epoch)
+        {
+            for (int k = 0; k < Epoch_Reader_Num; k++)
+            {
+                uint64_t idle = 0;
+                if (readers[slot].epoch.compare_exchange_strong(idle, epoch))
+                    return true;
+                slot = (slot + 1) % Epoch_Reader_Num;
+            }
+            return false;
+        }
+    };
+
+    struct RETIRED_NODE
+    {
+        KD_TREE_NODE *node;
+        uint64_t epoch;
+    };
+
+    struct RETIRED_FROZEN
+    {
+        FROZEN_TREE *frozen_tree;
+        uint64_t epoch;
+    };
+
+    // Slab allocator for tree nodes. Slabs are aligned to their size, so a node finds its slab by masking its address.
+    // Single nodes reuse freed slots; blocks (a whole rebuilt subtree) are carved contiguously from a slab.
+    class MANUAL_NODE_POOL
+    {
+    public:
+        MANUAL_NODE_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+        }
+        ~MANUAL_NODE_POOL()
+        {
+            while (all_slabs != nullptr)
+            {
+                NODE_SLAB *slab = all_slabs;
+                all_slabs = slab->all_next;
+                free(slab);
+            }
+            pthread_mutex_destroy(&pool_mutex_lock);
+        }
+        int block_capacity()
+        {
+            return (Node_Pool_Slab_Bytes - header_bytes()) / sizeof(KD_TREE_NODE);
+        }
+        KD_TREE_NODE *allocate()
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            NODE_SLAB *slab = available_slabs;
+            if (slab == nullptr)
+            {
+                slab = take_empty_slab();
+                link(slab, available_slabs, SLAB_AVAILABLE);
+            }
+            KD_TREE_NODE *node;
+            if (slab->free_head != nullptr)
+            {
+                node = slab->free_head;
+                slab->free_head = node->left_son_ptr;
+            }
+            else
+                node = slab_nodes(slab) + slab->bump++;
+            slab->live_num++;
+            if (slab->free_head == nullptr && slab->bump >= block_capacity())
+                unlink(slab, available_slabs);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return new (node) KD_TREE_NODE;
+        }
+        // n contiguous nodes, nullptr if n does not fit in one slab
+        KD_TREE_NODE *allocate_block(const int &n)
+        {
+            if (n <= 0 || n > block_capacity())
+                return nullptr;
+            pthread_mutex_lock(&pool_mutex_lock);
+            NODE_SLAB *slab = block_slab;
+            if (slab == nullptr || slab->bump + n > block_capacity())
+            {
+                slab = take_empty_slab();
+                link(slab, available_slabs, SLAB_AVAILABLE);
+                block_slab = slab;
+            }
+            KD_TREE_NODE *block = slab_nodes(slab) + slab->bump;
+            slab->bump += n;
+            slab->live_num += n;
+            if (slab->list_id == SLAB_AVAILABLE && slab->free_head == nullptr && slab->bump >= block_capacity())
+                unlink(slab, available_slabs);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            for (int i = 0; i < n; i++)
+                new (block + i) KD_TREE_NODE;
+            return block;
+        }
+        void release(KD_TREE_NODE *node)
+        {
+            NODE_SLAB *slab = (NODE_SLAB *)((uintptr_t)node & ~(uintptr_t)(Node_Pool_Slab_Bytes - 1));
+            pthread_mutex_lock(&pool_mutex_lock);
+            slab->live_num--;
+            if (slab->live_num == 0)
+            {
+                if (slab->list_id == SLAB_AVAILABLE)
+                    unlink(slab, available_slabs);
+                if (block_slab == slab)
+                    block_slab = nullptr;
+                slab->free_head = nullptr;
+                slab->bump = 0;
+                if (empty_slab_num < Node_Pool_Empty_Slab_Num)
+                {
+                    link(slab, empty_slabs, SLAB_EMPTY);
+                    empty_slab_num++;
+                }
+                else
+                {
+                    if (slab->all_prev != nullptr)
+                        slab->all_prev->all_next = slab->all_next;
+                    else
+                        all_slabs = slab->all_next;
+                    if (slab->all_next != nullptr)
+                        slab->all_next->all_prev = slab->all_prev;
+                    free(slab);
+                }
+            }
+            else
+            {
+                node->left_son_ptr = slab->free_head;
+                slab->free_head = node;
+                if (slab->list_id == SLAB_NONE)
+                    link(slab, available_slabs, SLAB_AVAILABLE);
+            }
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+
+    private:
+        enum slab_list_set
+        {
+            SLAB_NONE,
+            SLAB_AVAILABLE,
+            SLAB_EMPTY
+        };
+        struct NODE_SLAB
+        {
+            NODE_SLAB *prev = nullptr, *next = nullptr;
+            NODE_SLAB *all_prev = nullptr, *all_next = nullptr;
+            KD_TREE_NODE *free_head = nullptr;
+            int live_num = 0, bump = 0;
+            slab_list_set list_id = SLAB_NONE;
+        };
+        pthread_mutex_t pool_mutex_lock;
+        NODE_SLAB *all_slabs = nullptr, *available_slabs = nullptr, *empty_slabs = nullptr, *block_slab = nullptr;
+        int empty_slab_num = 0;
+        static size_t header_bytes()
+        {
+            return (sizeof(NODE_SLAB) + alignof(KD_TREE_NODE) - 1) / alignof(KD_TREE_NODE) * alignof(KD_TREE_NODE);
+        }
+        static KD_TREE_NODE *slab_nodes(NODE_SLAB *slab)
+        {
+            return (KD_TREE_NODE *)((char *)slab + header_bytes());
+        }
+        void link(NODE_SLAB *slab, NODE_SLAB *&list, const slab_list_set &list_id)
+        {
+            slab->prev = nullptr;
+            slab->next = list;
+            if (list != nullptr)
+                list->prev = slab;
+            list = slab;
+            slab->list_id = list_id;
+        }
+        void unlink(NODE_SLAB *slab, NODE_SLAB *&list)
+        {
+            if (slab->prev != nullptr)
+                slab->prev->next = slab->next;
+            else
+                list = slab->next;
+            if (slab->next != nullptr)
+                slab->next->prev = slab->prev;
+            slab->prev = slab->next = nullptr;
+            slab->list_id = SLAB_NONE;
+        }
+        NODE_SLAB *take_empty_slab()
+        {
+            NODE_SLAB *slab = empty_slabs;
+            if (slab != nullptr)
+            {
+                unlink(slab, empty_slabs);
+                empty_slab_num--;
+                return slab;
+            }
+            void *memory = nullptr;
+            if (posix_memalign(&memory, Node_Pool_Slab_Bytes, Node_Pool_Slab_Bytes) != 0)
+                throw std::bad_alloc();
+            slab = new (memory) NODE_SLAB;
+            slab->all_next = all_slabs;
+            if (all_slabs != nullptr)
+                all_slabs->all_prev = slab;
+            all_slabs = slab;
+            return slab;
+        }
+    };
+
+    class MANUAL_POOL
+    {
+    public:
+        MANUAL_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+            pthread_cond_init(&task_cond, NULL);
+            pthread_cond_init(&done_cond, NULL);
+        }
+        ~MANUAL_POOL()
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            terminated = true;
+            pthread_cond_broadcast(&task_cond);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            for (size_t i = 0; i < workers.size(); i++)
+                pthread_join(workers[i], NULL);
+            pthread_mutex_destroy(&pool_mutex_lock);
+            pthread_cond_destroy(&task_cond);
+            pthread_cond_destroy(&done_cond);
         }
         int size()
         {
-            return counter;
+            return std::max(1, int(std::thread::hardware_concurrency()));
+        }
+        // Runs task(0) ... task(task_num - 1) on the workers and the calling thread, returns when all are done.
+        // Nested or concurrent calls while the pool is busy run on the calling thread.
+        void run(const int &task_num, const std::function<void(int)> &task)
+        {
+            if (task_num <= 1 || size() == 1)
+            {
+                for (int i = 0; i < task_num; i++)
+                    task(i);
+                return;
+            }
+            pthread_mutex_lock(&pool_mutex_lock);
+            // Workers start with the first parallel run, under the lock as concurrent queries may both get here
+            if (workers.empty())
+                start();
+            if (busy)
+            {
+                pthread_mutex_unlock(&pool_mutex_lock);
+                for (int i = 0; i < task_num; i++)
+                    task(i);
+                return;
+            }
+            busy = true;
+            job = &task;
+            job_task_num = task_num;
+            next_task = 0;
+            finished_task_num = 0;
+            pthread_cond_broadcast(&task_cond);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            work();
+            pthread_mutex_lock(&pool_mutex_lock);
+            while (finished_task_num < job_task_num)
+                pthread_cond_wait(&done_cond, &pool_mutex_lock);
+            job = nullptr;
+            busy = false;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+
+    private:
+        vector<pthread_t> workers;
+        pthread_mutex_t pool_mutex_lock;
+        pthread_cond_t task_cond, done_cond;
+        const std::function<void(int)> *job = nullptr;
+        int job_task_num = 0, next_task = 0, finished_task_num = 0;
+        bool busy = false, terminated = false;
+        void start()
+        {
+            workers.resize(size() - 1);
+            for (size_t i = 0; i < workers.size(); i++)
+                pthread_create(&workers[i], NULL, worker_ptr, (void *)this);
+        }
+        static void *worker_ptr(void *arg)
+        {
+            MANUAL_POOL *pool = (MANUAL_POOL *)arg;
+            pthread_mutex_lock(&pool->pool_mutex_lock);
+            while (!pool->terminated)
+            {
+                if (pool->job != nullptr && pool->next_task < pool->job_task_num)
+                {
+                    pthread_mutex_unlock(&pool->pool_mutex_lock);
+                    pool->work();
+                    pthread_mutex_lock(&pool->pool_mutex_lock);
+                }
+                else
+                    pthread_cond_wait(&pool->task_cond, &pool->pool_mutex_lock);
+            }
+            pthread_mutex_unlock(&pool->pool_mutex_lock);
+            return nullptr;
+        }
+        void work()
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            while (job != nullptr && next_task < job_task_num)
+            {
+                int task_index = next_task++;
+                const std::function<void(int)> *task = job;
+                pthread_mutex_unlock(&pool_mutex_lock);
+                (*task)(task_index);
+                pthread_mutex_lock(&pool_mutex_lock);
+                if (++finished_task_num == job_task_num)
+                    pthread_cond_broadcast(&done_cond);
+            }
+            pthread_mutex_unlock(&pool_mutex_lock);
         }
     };
 
 private:
+    // Node storage, see MANUAL_NODE_POOL
+    MANUAL_NODE_POOL Node_Pool;
+    // Worker threads for batched queries and voxelization
+    MANUAL_POOL Worker_Pool;
     // Multi-thread Tree Rebuild
+    // One background rebuild: its subtree, the operations it missed and the thread doing it.
+    // The subtrees of the slots are kept disjoint, so their rebuilds run at the same time.
+    struct REBUILD_SLOT
+    {
+        KD_TREE *tree = nullptr;
+        int slot_id = 0;
+        pthread_t rebuild_thread;
+        KD_TREE_NODE **Rebuild_Ptr = nullptr;
+        // Taken by the thread, Rebuild can no longer replace or drop it
+        bool running = false;
+        // Operations on the subtree are logged while set
+        bool rebuild_flag = false;
+        MANUAL_Q Rebuild_Logger;
+        PointVector Rebuild_PCL_Storage;
+    };
     bool termination_flag = false;
-    bool rebuild_flag = false;
-    pthread_t rebuild_thread;
-    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
-    pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
-    // queue<Operation_Logger_Type> Rebuild_Logger;
-    MANUAL_Q Rebuild_Logger;
-    PointVector Rebuild_PCL_Storage;
-    KD_TREE_NODE **Rebuild_Ptr = nullptr;
-    int search_mutex_counter = 0;
+    REBUILD_SLOT Rebuild_Slots[Rebuild_Slot_Num];
+    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex;
+    pthread_mutex_t points_deleted_rebuild_mutex_lock;
+    // Rebuilds abandoned because their log overflowed
+    std::atomic<int> Rebuild_Overflow_Num{0};
+    // Broadcast (with rebuild_ptr_mutex_lock) when a slot is posted or finished
+    pthread_cond_t rebuild_ptr_cond;
+    // Slot rebuilding the subtree rooted at node, -1 if there is none
+    int Rebuild_Slot_Of(KD_TREE_NODE *node)
+    {
+        if (node == nullptr)
+            return -1;
+        for (int i = 0; i < Rebuild_Slot_Num; i++)
+        {
+            KD_TREE_NODE **rebuild_ptr = Rebuild_Slots[i].Rebuild_Ptr;
+            if (rebuild_ptr != nullptr && *rebuild_ptr == node)
+                return i;
+        }
+        return -1;
+    }
+    // Readers, see MANUAL_EPOCH. Nodes unlinked by the writer or the rebuild threads wait in Retired_Nodes,
+    // replaced frozen layouts in Retired_Frozen
+    MANUAL_EPOCH Epoch;
+    pthread_mutex_t retire_mutex_lock;
+    vector<RETIRED_NODE> Retired_Nodes;
+    vector<RETIRED_FROZEN> Retired_Frozen;
+    void Retire_Nodes(KD_TREE_NODE *root, const uint64_t &epoch);
+    void Reclaim_Nodes(const bool &force);
+    // Links a fully built node or subtree, readers following *link see it initialized
+    void Publish_Node(KD_TREE_NODE **link, KD_TREE_NODE *node)
+    {
+        std::atomic_thread_fence(std::memory_order_release);
+        *link = node;
+    }
     static void *multi_thread_ptr(void *arg);
-    void multi_thread_rebuild();
+    void multi_thread_rebuild(const int &slot_id);
     void start_thread();
     void stop_thread();
     void run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation);
+    void Replay_Operations(KD_TREE_NODE **root, vector<Operation_Logger_Type> &operations);
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
     float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
+    // For paper data record, kept for Root_Node only
+    float root_alpha_bal = 0.5, root_alpha_del = 0.0;
+    // Labels of node as Push_Down would leave them, father_labels being what its father passes down
+    LAZY_LABELS Lazy_Labels(KD_TREE_NODE *node, const LAZY_LABELS &father_labels)
+    {
+        LAZY_LABELS labels;
+        labels.pushed = father_labels.pushed;
+        if (!father_labels.pushed)
+        {
+            labels.tree_deleted = node->tree_deleted;
+            labels.tree_downsample_deleted = node->tree_downsample_deleted;
+            labels.point_deleted = node->point_deleted;
+            labels.point_downsample_deleted = node->point_downsample_deleted;
+            return labels;
+        }
+        labels.tree_downsample_deleted = node->tree_downsample_deleted || father_labels.tree_downsample_deleted;
+        labels.point_downsample_deleted = node->point_downsample_deleted || father_labels.tree_downsample_deleted;
+        labels.tree_deleted = father_labels.tree_deleted || labels.tree_downsample_deleted;
+        labels.point_deleted = labels.tree_deleted || labels.point_downsample_deleted;
+        return labels;
+    }
+    // Valid points and valid covered points of node as Push_Down would leave them
+    void Lazy_Counts(KD_TREE_NODE *node, const LAZY_LABELS &father_labels, int &valid_num, int &covered_num)
+    {
+        int invalid_num = node->invalid_point_num;
+        int covered_invalid_num = node->covered_invalid_num;
+        if (father_labels.pushed)
+        {
+            int down_del_num = father_labels.tree_downsample_deleted ? node->TreeSize : node->down_del_num;
+            int covered_down_del_num = father_labels.tree_downsample_deleted ? node->covered_num : node->covered_down_del_num;
+            invalid_num = father_labels.tree_deleted ? node->TreeSize : down_del_num;
+            covered_invalid_num = father_labels.tree_deleted ? node->covered_num : covered_down_del_num;
+        }
+        valid_num = node->TreeSize - invalid_num;
+        covered_num = node->covered_num - covered_invalid_num;
+    }
+    // What a node with labels passes down to a son
+    LAZY_LABELS Son_Labels(const LAZY_LABELS &labels, const bool &need_push_down)
+    {
+        LAZY_LABELS son_labels = labels;
+        son_labels.pushed = labels.pushed || need_push_down;
+        return son_labels;
+    }
+    LAZY_LABELS Son_Labels(const LAZY_LABELS &labels, const NODE_LABEL &need_push_down)
+    {
+        return Son_Labels(labels, need_push_down.load_acquire());
+    }
+    // Labels of slot i of a bucket as Push_Down would leave them, slot_labels being what its leaf passes down
+    bool Slot_Deleted(LEAF_BUCKET *bucket, const int &i, const LAZY_LABELS &slot_labels)
+    {
+        if (slot_labels.pushed)
+            return slot_labels.tree_deleted || bucket->point_downsample_deleted[i];
+        return bucket->point_deleted[i];
+    }
+    bool Slot_Downsample_Deleted(LEAF_BUCKET *bucket, const int &i, const LAZY_LABELS &slot_labels)
+    {
+        return bucket->point_downsample_deleted[i] || (slot_labels.pushed && slot_labels.tree_downsample_deleted);
+    }
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
     float downsample_size = 0.2f;
     float inv_downsample_size = 1.0f;
+    // Points a leaf keeps in its bucket besides its own, 0: no buckets
+    int leaf_bucket_size = 0;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE *STATIC_ROOT_NODE = nullptr;
     PointVector Points_deleted;
-    PointVector Downsample_Storage;
     PointVector Multithread_Points_deleted;
+    // Sparse voxel occupancy: voxel key -> number of valid points in the voxel. Only kept from the first
+    // Add_Points with downsample_on until the tree is built, frozen or deleted again
+    unordered_map<int64_t, int> Voxel_Occupancy;
+    bool Voxel_Occupancy_On = false;
+    // Per-depth index lists of the batched Set_Covered_by_points descent
+    vector<vector<int>> Covered_Query_Stack;
+    // Queries are answered from here instead of Root_Node while it is set. Queries load it once inside
+    // their epoch, the writer replaces it with Frozen_Publish
+    std::atomic<FROZEN_TREE *> Frozen_Tree{nullptr};
     void InitTreeNode(KD_TREE_NODE *root);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE **root, const int &l, const int &r, PointVector &Storage);
+    void BuildTree(KD_TREE_NODE **root, const int &l, const int &r, PointVector &Storage, KD_TREE_NODE *block = nullptr, const ARRANGED_SPLIT *arranged = nullptr);
+    int Split_Storage(const int &l, const int &r, PointVector &Storage, const bool &parallel_scan, int &div_axis);
+    int Strict_Split(const int &l, const int &r, PointVector &Storage, const int &div_axis);
+    void Arrange_Storage(const int &l, const int &r, PointVector &Storage, ARRANGED_SPLIT *arranged, const int &fork_depth, const bool &parallel_scan = false);
+    int Build_Fork_Depth();
+    int Build_Node_Num(const int &l, const int &r, const ARRANGED_SPLIT *arranged);
+    void Bucket_Append(KD_TREE_NODE *leaf, const PointType &point);
+    void Bucket_Split(KD_TREE_NODE **root, const PointType &point);
+    void Release_Node(KD_TREE_NODE *node);
     void Rebuild(KD_TREE_NODE **root);
+    bool Rebuild_Contains(KD_TREE_NODE *root, KD_TREE_NODE *node);
+    void Rebuild_Drop(const int &slot_id);
     int Delete_by_range(KD_TREE_NODE **root, const BoxPointType &boxpoint, const bool &allow_rebuild, const bool &is_downsample);
     void Delete_by_point(KD_TREE_NODE **root, const PointType &point, const bool &allow_rebuild);
-    void Delete_by_point_accurate(KD_TREE_NODE **root, const PointType &point, const bool &allow_rebuild);
-    int Set_Covered_by_point(KD_TREE_NODE *root, const PointType &point);
-    void Get_Points_Covered(KD_TREE_NODE *root, PointVector &Storage, const bool &get_covered_or_uncovered);
+    int Set_Covered_by_point(KD_TREE_NODE **root, const PointType &point);
+    void Set_Covered_by_points(KD_TREE_NODE **root, const PointVector &PointsCovered, const int &depth);
+    bool Sensor_Point_Visible(const SENSOR_QUERY &sensor, const PointType &point);
+    bool Sensor_Box_Culled(const SENSOR_QUERY &sensor, KD_TREE_NODE *node);
+    int Sensor_Cover_Bucket(KD_TREE_NODE *leaf, const SENSOR_QUERY &sensor, MANUAL_Q *log);
+    int Sensor_Split(KD_TREE_NODE **link, const SENSOR_QUERY &sensor, const int &depth, vector<KD_TREE_NODE **> &tasks, SENSOR_TASK &top);
+    int Set_Covered_by_sensor(KD_TREE_NODE *root, const SENSOR_QUERY &sensor, SENSOR_TASK *task, MANUAL_Q *log);
+    void Get_Points_Covered(KD_TREE_NODE *root, PointVector &Storage, const bool &get_covered_or_uncovered, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    void Covered_Count_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, int &covered_num, int &uncovered_num, const LAZY_LABELS &father_labels = LAZY_LABELS());
     void Add_by_point(KD_TREE_NODE **root, const PointType &point, const bool &allow_rebuild, const int &father_axis);
     void Add_by_range(KD_TREE_NODE **root, const BoxPointType &boxpoint, const bool &allow_rebuild);
-    void Search(KD_TREE_NODE *root, const int &k_nearest, const PointType &point, MANUAL_HEAP &q, const float &max_dist); //priority_queue<PointType_CMP>
-    void Search_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, PointVector &Storage);
-    void Search_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius, PointVector &Storage);
-    bool CollisionCheckRecursive(KD_TREE_NODE *root, const PointType &point, const float &radius);
+    template <typename HeapType>
+    void Search(KD_TREE_NODE *root, const int &k_nearest, const PointType &point, HeapType &q, const float &max_dist, const LAZY_LABELS &father_labels = LAZY_LABELS()); //priority_queue<PointType_CMP>
+    template <typename HeapType>
+    int Nearest_Search_by_heap(const PointType &point, const int &k_nearest, HeapType &q, PointType *Nearest_Points, float *Point_Distance, const float &max_dist);
+    void Search_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, PointVector &Storage, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    void Search_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, PointVector &Storage, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    int Count_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    int Count_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    bool CollisionCheckRecursive(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    template <typename Visitor>
+    bool Visit_Subtree(KD_TREE_NODE *root, Visitor &visitor, const LAZY_LABELS &father_labels);
+    template <typename Visitor>
+    bool Visit_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, Visitor &visitor, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    template <typename Visitor>
+    bool Visit_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, Visitor &visitor, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    void Ray_Cast_Recursive(KD_TREE_NODE *root, const RAY_QUERY &ray, const float &max_dist, float &hit_dist, const LAZY_LABELS &father_labels = LAZY_LABELS());
+    bool Ray_Query_Init(const PointType &pt, const PointType &dir, const float &radius, RAY_QUERY &ray);
+    float Ray_Cast_Dist(const RAY_QUERY &ray, const float &max_dist);
+    float Ray_Box_Entry(const RAY_QUERY &ray, const float *box_min, const float *box_max, const float &t_max);
+    float Ray_Node_Entry(const RAY_QUERY &ray, KD_TREE_NODE *node, const float &t_max);
+    float Ray_Point_Entry(const RAY_QUERY &ray, const PointType &point);
+    bool Segment_Check(const PointType &point1, const PointType &point2, const float &radius, const PointType *excluded);
+    float Segment_Query_Init(const PointType &point1, const PointType &point2, const float &radius, RAY_QUERY &segment);
+    bool Segment_Check_Dist(const RAY_QUERY &segment, const float &length, const PointType *excluded);
+    bool Segment_Check_Recursive(KD_TREE_NODE *root, const RAY_QUERY &segment, const float &length, const PointType *excluded, const LAZY_LABELS &father_labels = LAZY_LABELS());
     bool Criterion_Check(KD_TREE_NODE *root);
     void Push_Down(KD_TREE_NODE *root);
     void Update(KD_TREE_NODE *root);
     void delete_tree_nodes(KD_TREE_NODE **root);
     void downsample(KD_TREE_NODE **root);
+    int64_t voxel_key(const PointType &point);
+    template <typename Func>
+    void parallel_for(const int &task_num, Func func);
+    bool on_rebuild_thread();
+    bool voxel_occupancy_tracked();
+    void Voxel_Occupancy_Init();
+    void Voxel_Occupancy_Reset();
+    void Voxel_Occupancy_Insert(const PointType &point);
+    void Voxel_Occupancy_Erase(const PointType &point);
+    void Voxel_Occupancy_Update_Subtree(KD_TREE_NODE *root, const bool &insert_restored, const LAZY_LABELS &father_labels = LAZY_LABELS());
     bool same_point(const PointType &a, const PointType &b);
+    bool box_contains(const BoxPointType &outer, const BoxPointType &inner);
     float calc_dist(const PointType &a, const PointType &b);
     float calc_box_dist(KD_TREE_NODE *node, const PointType &point);
+    float calc_box_max_dist(KD_TREE_NODE *node, const PointType &point);
+    static size_t Frozen_Block_Bytes(const int &node_num);
+    void Frozen_Assign(FROZEN_TREE &frozen_tree, char *block, const int &node_num);
+    void Frozen_Publish(FROZEN_TREE *frozen_tree);
+    void Frozen_Free(FROZEN_TREE *frozen_tree);
+    void Snapshot_Header_Init(SNAPSHOT_HEADER &header, const int &node_num);
+    void Frozen_Build(FROZEN_TREE &frozen_tree, const int &p, const int &n, PointVector &Storage, const int &l);
+    float Frozen_Box_Dist(const FROZEN_TREE &frozen_tree, const int &p, const PointType &point);
+    float Frozen_Box_Max_Dist(const FROZEN_TREE &frozen_tree, const int &p, const PointType &point);
+    static void Bucket_Dist(const float *xs, const float *ys, const float *zs, const int &n, const PointType &point, float *dist);
+    void Frozen_Bucket_Dist(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, float *dist);
+    template <typename HeapType>
+    void Frozen_Search(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const int &k_nearest, const PointType &point, HeapType &q, const float &max_dist_sqr);
+    void Frozen_Search_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, PointVector &Storage);
+    void Frozen_Search_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq, PointVector &Storage);
+    int Frozen_Count_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint);
+    int Frozen_Count_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq);
+    template <typename Visitor>
+    bool Frozen_Visit_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, Visitor &visitor);
+    template <typename Visitor>
+    bool Frozen_Visit_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq, Visitor &visitor);
+    bool Frozen_Collision_Check(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq);
+    void Frozen_Get_Covered(const FROZEN_TREE &frozen_tree, const int &p, const int &n, PointVector &Storage, const bool &get_covered_or_uncovered);
+    void Frozen_Covered_Count(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, int &covered_num, int &uncovered_num);
+    float Frozen_Ray_Entry(const FROZEN_TREE &frozen_tree, const RAY_QUERY &ray, const int &p, const float &t_max);
+    void Frozen_Ray_Cast(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const RAY_QUERY &ray, const float &max_dist, float &hit_dist);
+    bool Frozen_Segment_Check(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const RAY_QUERY &segment, const float &length, const PointType *excluded);
     static bool point_cmp_x(const PointType &a, const PointType &b);
     static bool point_cmp_y(const PointType &a, const PointType &b);
     static bool point_cmp_z(const PointType &a, const PointType &b);
@@ -340,19 +1221,42 @@ public:
         inv_downsample_size = 1.0f / downsample_size;
         return;
     }
+    // Leaves keep up to bucket_size points besides their own (at most Leaf_Bucket_Max), scanned with
+    // Bucket_Dist instead of one node per point. 0 (the default) turns buckets off, existing buckets
+    // stay until their leaves are rebuilt
+    void set_leaf_bucket_size(const int &bucket_size);
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
+    int rebuild_log_overflow();
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector &point_cloud);
     void Reconstruct(PointVector &PointToRecon);
+    void Voxelize_Points(const PointVector &PointToVoxelize, PointVector &Voxel_Centers);
+    void Freeze();
+    void Unfreeze();
+    bool Save_Snapshot(const string &path);
+    bool Load_Snapshot(const string &path);
+    bool frozen() { return Frozen_Tree.load(std::memory_order_acquire) != nullptr; }
     void Nearest_Search(const PointType &point, const int &k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, const float &max_dist = INFINITY);
+    int Nearest_Search(const PointType &point, const int &k_nearest, PointType *Nearest_Points, float *Point_Distance, const float &max_dist = INFINITY);
+    void Nearest_Search_Batch(const PointVector &Query_Points, const int &k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, vector<int> &Found_Num, const float &max_dist = INFINITY);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(const PointType &point, const float &radius, PointVector &Storage);
+    int Box_Count(const BoxPointType &Box_of_Point);
+    int Radius_Count(const PointType &point, const float &radius);
+    // Box_Search and Radius_Search without a copy: visitor(point) is called for every point found and
+    // returns false to stop the search. They return false if the visitor stopped them
+    template <typename Visitor>
+    bool Box_Visit(const BoxPointType &Box_of_Point, Visitor &&visitor);
+    template <typename Visitor>
+    bool Radius_Visit(const PointType &point, const float &radius, Visitor &&visitor);
     bool CollisionCheck(const PointType &point, const float &radius);
     bool CollisionLineCheck(const PointType &point1, const PointType &point2, const float &radius);
     bool CollisionLineCheckExceptOrigin(const PointType &origin, const PointType &point1, const PointType &point2, const float &radius);
-    void Ray_Cast(const PointType &pt, const PointType &dir, const float& radius, PointType& hit_point, const float& max_dist = 100.0f);
+    void CollisionLineCheck_Batch(const PointVector &Start_Points, const PointVector &End_Points, const float &radius, vector<int> &Collision, const bool &except_start = false);
+    bool Ray_Cast(const PointType &pt, const PointType &dir, const float& radius, PointType& hit_point, const float& max_dist = 100.0f);
+    void Ray_Cast_Batch(const PointType &pt, const PointVector &Directions, const float &radius, PointVector &Hit_Points, vector<float> &Hit_Distance, const float &max_dist = 100.0f);
     int Add_Points(const PointVector &PointToAdd, const bool &downsample_on);
     void Add_Point_Boxes(const vector<BoxPointType> &BoxPoints);
     void Delete_Points(const PointVector &PointToDel);
@@ -360,8 +1264,11 @@ public:
     void Delete_Points_Accurate(const PointVector &PointToDel);
     int Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints);
     void Set_Covered_Points(const PointVector &PointsCovered);
+    int Set_Covered_By_Sensor(const Eigen::Matrix4f &pose, const float &fov_h, const float &fov_v, const float &max_range);
     void Get_Covered_Points(PointVector &Storage, const bool &get_covered_or_uncovered = true);
-    void flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type);
+    float covered_ratio();
+    void Box_Covered_Count(const BoxPointType &Box_of_Point, int &covered_num, int &uncovered_num);
+    void flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type, const LAZY_LABELS &father_labels = LAZY_LABELS());
     void acquire_removed_points(PointVector &removed_points);
     void Delete_Ikd_Tree();
     BoxPointType tree_range();
@@ -370,5 +1277,193 @@ public:
     int max_queue_size = 0;
 };
 
+// Visitor queries are templated on the visitor, so they are defined here rather than in ikd_Tree.cpp
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Box_Visit(const BoxPointType &Box_of_Point, Visitor &&visitor)
+{
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    bool finished = frozen_tree != nullptr ? Frozen_Visit_by_range(*frozen_tree, 0, frozen_tree->node_num, Box_of_Point, visitor) : Visit_by_range(Root_Node, Box_of_Point, visitor);
+    Epoch.leave(reader);
+    return finished;
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Radius_Visit(const PointType &point, const float &radius, Visitor &&visitor)
+{
+    int reader = Epoch.enter();
+    const FROZEN_TREE *frozen_tree = Frozen_Tree.load(std::memory_order_acquire);
+    bool finished = frozen_tree != nullptr ? Frozen_Visit_by_radius(*frozen_tree, 0, frozen_tree->node_num, point, radius * radius, visitor) : Visit_by_radius(Root_Node, point, radius * radius, visitor);
+    Epoch.leave(reader);
+    return finished;
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_Subtree(KD_TREE_NODE *root, Visitor &visitor, const LAZY_LABELS &father_labels)
+{
+    // flatten with NOT_RECORD, one point at a time
+    if (root == nullptr)
+        return true;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return true;
+    if (!labels.point_deleted && !visitor(root->point))
+        return false;
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+            if (!Slot_Deleted(bucket, i, slot_labels) && !visitor(bucket->points[i]))
+                return false;
+    }
+    if (!Visit_Subtree(root->left_son_ptr, visitor, Son_Labels(labels, root->need_push_down_to_left)))
+        return false;
+    return Visit_Subtree(root->right_son_ptr, visitor, Son_Labels(labels, root->need_push_down_to_right));
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, Visitor &visitor, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return true;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted)
+        return true;
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return true;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return true;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return true;
+    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+        return Visit_Subtree(root, visitor, father_labels);
+    if (!labels.point_deleted && boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+    {
+        if (!visitor(root->point))
+            return false;
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        for (int i = 0; i < point_num; i++)
+        {
+            if (boxpoint.vertex_min[0] <= bucket->coord[0][i] && boxpoint.vertex_max[0] > bucket->coord[0][i] && boxpoint.vertex_min[1] <= bucket->coord[1][i] && boxpoint.vertex_max[1] > bucket->coord[1][i] && boxpoint.vertex_min[2] <= bucket->coord[2][i] && boxpoint.vertex_max[2] > bucket->coord[2][i])
+            {
+                if (!Slot_Deleted(bucket, i, slot_labels) && !visitor(bucket->points[i]))
+                    return false;
+            }
+        }
+    }
+    if (!Visit_by_range(root->left_son_ptr, boxpoint, visitor, Son_Labels(labels, root->need_push_down_to_left)))
+        return false;
+    return Visit_by_range(root->right_son_ptr, boxpoint, visitor, Son_Labels(labels, root->need_push_down_to_right));
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_by_radius(KD_TREE_NODE *root, const PointType &point, const float &radius_sq, Visitor &visitor, const LAZY_LABELS &father_labels)
+{
+    if (root == nullptr)
+        return true;
+    LAZY_LABELS labels = Lazy_Labels(root, father_labels);
+    if (labels.tree_deleted || calc_box_dist(root, point) > radius_sq)
+        return true;
+    if (calc_box_max_dist(root, point) <= radius_sq)
+        return Visit_Subtree(root, visitor, father_labels);
+    if (!labels.point_deleted && calc_dist(root->point, point) <= radius_sq)
+    {
+        if (!visitor(root->point))
+            return false;
+    }
+    LEAF_BUCKET *bucket = root->bucket;
+    if (bucket != nullptr)
+    {
+        LAZY_LABELS slot_labels = Son_Labels(labels, root->need_push_down_to_left);
+        int point_num = bucket->point_num.load(std::memory_order_acquire);
+        float bucket_dist[Leaf_Bucket_Max];
+        Bucket_Dist(bucket->coord[0], bucket->coord[1], bucket->coord[2], point_num, point, bucket_dist);
+        for (int i = 0; i < point_num; i++)
+            if (bucket_dist[i] <= radius_sq && !Slot_Deleted(bucket, i, slot_labels) && !visitor(bucket->points[i]))
+                return false;
+    }
+    if (!Visit_by_radius(root->left_son_ptr, point, radius_sq, visitor, Son_Labels(labels, root->need_push_down_to_left)))
+        return false;
+    return Visit_by_radius(root->right_son_ptr, point, radius_sq, visitor, Son_Labels(labels, root->need_push_down_to_right));
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Frozen_Visit_by_range(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const BoxPointType &boxpoint, Visitor &visitor)
+{
+    bool contained = true;
+    for (int i = 0; i < 3; i++)
+    {
+        if (boxpoint.vertex_max[i] <= frozen_tree.range_min[i][p] || boxpoint.vertex_min[i] > frozen_tree.range_max[i][p])
+            return true;
+        contained = contained && boxpoint.vertex_min[i] <= frozen_tree.range_min[i][p] && boxpoint.vertex_max[i] > frozen_tree.range_max[i][p];
+    }
+    // A contained subtree, a leaf bucket or the split point alone
+    int point_num = (contained || n <= Frozen_Bucket_Size) ? n : 1;
+    for (int i = p; i < p + point_num; i++)
+    {
+        const PointType &point = frozen_tree.points[i];
+        if (contained || (boxpoint.vertex_min[0] <= point.x && boxpoint.vertex_max[0] > point.x && boxpoint.vertex_min[1] <= point.y && boxpoint.vertex_max[1] > point.y && boxpoint.vertex_min[2] <= point.z && boxpoint.vertex_max[2] > point.z))
+        {
+            if (!visitor(point))
+                return false;
+        }
+    }
+    if (point_num == n)
+        return true;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0 && !Frozen_Visit_by_range(frozen_tree, p + 1, left_num, boxpoint, visitor))
+        return false;
+    return right_num == 0 || Frozen_Visit_by_range(frozen_tree, p + 1 + left_num, right_num, boxpoint, visitor);
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Frozen_Visit_by_radius(const FROZEN_TREE &frozen_tree, const int &p, const int &n, const PointType &point, const float &radius_sq, Visitor &visitor)
+{
+    if (Frozen_Box_Dist(frozen_tree, p, point) > radius_sq)
+        return true;
+    if (Frozen_Box_Max_Dist(frozen_tree, p, point) <= radius_sq)
+    {
+        for (int i = p; i < p + n; i++)
+            if (!visitor(frozen_tree.points[i]))
+                return false;
+        return true;
+    }
+    if (n <= Frozen_Bucket_Size)
+    {
+        float bucket_dist[Frozen_Bucket_Size];
+        Frozen_Bucket_Dist(frozen_tree, p, n, point, bucket_dist);
+        for (int i = 0; i < n; i++)
+            if (bucket_dist[i] <= radius_sq && !visitor(frozen_tree.points[p + i]))
+                return false;
+        return true;
+    }
+    if (calc_dist(frozen_tree.points[p], point) <= radius_sq && !visitor(frozen_tree.points[p]))
+        return false;
+    int left_num = (n - 1) >> 1;
+    int right_num = n - 1 - left_num;
+    if (left_num > 0 && !Frozen_Visit_by_radius(frozen_tree, p + 1, left_num, point, radius_sq, visitor))
+        return false;
+    return right_num == 0 || Frozen_Visit_by_radius(frozen_tree, p + 1 + left_num, right_num, point, radius_sq, visitor);
+}
+
 // template <typename PointType>
-// PointType KD_TREE<PointType>::zeroP = PointType(0,0,0);
\ No newline at end of file
+// PointType KD_TREE<PointType>::zeroP = PointType(0,0,0);
+
+#ifdef IKD_TREE_HEADER_ONLY
+#include "ikd_Tree.cpp"
+#endif